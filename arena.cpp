@@ -0,0 +1,53 @@
+#include <algorithm>
+#include <cstddef>
+
+#include "arena.h"
+
+#ifdef HAVE_MEMORY_RESOURCE
+
+link_arena::link_arena() :
+	_buffer(64 * 1024), _counter(&_buffer, _stats)
+{}
+
+link_arena::~link_arena() {}
+
+void link_arena::release() {
+	_buffer.release();
+	_counter.reset();
+	_stats.releases++;
+}
+
+/*
+ * live bytes drop when a vector frees its old buffer, but the monotonic
+ * buffer only gets the space back on release(), so held bytes only grow.
+ */
+void *link_arena::counting_resource::do_allocate(size_t bytes, size_t alignment) {
+	void *p = _upstream->allocate(bytes, alignment);
+	_stats.allocations++;
+	_stats.bytes += bytes;
+	_live += bytes;
+	_held += bytes;
+	_stats.peak = std::max(_stats.peak, _live);
+	_stats.held = std::max(_stats.held, _held);
+	return p;
+}
+
+void link_arena::counting_resource::do_deallocate(void *p, size_t bytes, size_t alignment) {
+	_upstream->deallocate(p, bytes, alignment);
+	_live -= bytes;
+}
+
+bool link_arena::counting_resource::do_is_equal(const std::pmr::memory_resource &other) const noexcept {
+	return this == &other;
+}
+
+#else
+
+link_arena::link_arena() {}
+link_arena::~link_arena() {}
+
+void link_arena::release() {
+	_stats.releases++;
+}
+
+#endif
@@ -0,0 +1,92 @@
+#ifndef arena_h
+#define arena_h
+
+#include <cstddef>
+#include <memory>
+#include <vector>
+
+#if __has_include(<memory_resource>)
+#include <memory_resource>
+#define HAVE_MEMORY_RESOURCE 1
+#endif
+
+/*
+ * Per-link allocation.  Segment data and relocations, pending relocations,
+ * unit symbol remaps and object record scratch come from a monotonic arena
+ * which is released in one shot when the link (or, with --stream, each
+ * segment) is finished.  Allocations are counted for --stats.
+ *
+ * One per link_context, so not thread safe.  Without <memory_resource>
+ * this is the regular allocator and nothing is counted.
+ */
+
+#ifdef HAVE_MEMORY_RESOURCE
+template<class T> using arena_allocator = std::pmr::polymorphic_allocator<T>;
+#else
+template<class T> using arena_allocator = std::allocator<T>;
+#endif
+
+template<class T> using arena_vector = std::vector<T, arena_allocator<T>>;
+
+
+struct arena_stats {
+	size_t allocations = 0;
+	size_t bytes = 0;
+	size_t peak = 0; /* most bytes in use at once */
+	size_t held = 0; /* most bytes the arena held between releases */
+	size_t releases = 0;
+};
+
+class link_arena {
+public:
+
+	link_arena();
+	~link_arena();
+
+	link_arena(const link_arena &) = delete;
+	link_arena &operator=(const link_arena &) = delete;
+
+	template<class T>
+	arena_allocator<T> allocator() {
+#ifdef HAVE_MEMORY_RESOURCE
+		return arena_allocator<T>(&_counter);
+#else
+		return arena_allocator<T>();
+#endif
+	}
+
+	/* nb - everything allocated from the arena must be gone */
+	void release();
+
+	const arena_stats &stats() const { return _stats; }
+
+private:
+
+	arena_stats _stats;
+
+#ifdef HAVE_MEMORY_RESOURCE
+	class counting_resource : public std::pmr::memory_resource {
+	public:
+		counting_resource(std::pmr::memory_resource *upstream, arena_stats &stats) :
+			_upstream(upstream), _stats(stats)
+		{}
+
+		void reset() { _live = 0; _held = 0; }
+
+	private:
+		void *do_allocate(size_t bytes, size_t alignment) override;
+		void do_deallocate(void *p, size_t bytes, size_t alignment) override;
+		bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override;
+
+		std::pmr::memory_resource *_upstream;
+		arena_stats &_stats;
+		size_t _live = 0;
+		size_t _held = 0;
+	};
+
+	std::pmr::monotonic_buffer_resource _buffer;
+	counting_resource _counter;
+#endif
+};
+
+#endif
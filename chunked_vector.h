@@ -0,0 +1,86 @@
+#ifndef chunked_vector_h
+#define chunked_vector_h
+
+#include <cstddef>
+#include <iterator>
+#include <memory>
+#include <vector>
+
+/*
+ * Append-only vector with stable element addresses.  Storage is a list
+ * of fixed size chunks so growing never moves an element and an index
+ * (or pointer) stays valid until clear().
+ */
+template<class T, unsigned ChunkBits = 10>
+class chunked_vector {
+
+	enum : size_t {
+		chunk_size = size_t(1) << ChunkBits,
+		chunk_mask = chunk_size - 1,
+	};
+
+public:
+
+	template<class V, class C>
+	class basic_iterator {
+	public:
+		typedef std::forward_iterator_tag iterator_category;
+		typedef V value_type;
+		typedef std::ptrdiff_t difference_type;
+		typedef V *pointer;
+		typedef V &reference;
+
+		basic_iterator(C *c, size_t ix) : _c(c), _ix(ix) {}
+
+		V &operator*() const { return (*_c)[_ix]; }
+		V *operator->() const { return &(*_c)[_ix]; }
+		basic_iterator &operator++() { ++_ix; return *this; }
+		basic_iterator operator++(int) { auto tmp = *this; ++_ix; return tmp; }
+		bool operator==(const basic_iterator &o) const { return _ix == o._ix; }
+		bool operator!=(const basic_iterator &o) const { return _ix != o._ix; }
+
+	private:
+		C *_c;
+		size_t _ix;
+	};
+
+	typedef basic_iterator<T, chunked_vector> iterator;
+	typedef basic_iterator<const T, const chunked_vector> const_iterator;
+
+
+	chunked_vector() = default;
+
+	chunked_vector(const chunked_vector &) = delete;
+	chunked_vector &operator=(const chunked_vector &) = delete;
+
+	size_t size() const { return _size; }
+	bool empty() const { return _size == 0; }
+
+	T &operator[](size_t i) { return _chunks[i >> ChunkBits][i & chunk_mask]; }
+	const T &operator[](size_t i) const { return _chunks[i >> ChunkBits][i & chunk_mask]; }
+
+	iterator begin() { return iterator(this, 0); }
+	iterator end() { return iterator(this, _size); }
+	const_iterator begin() const { return const_iterator(this, 0); }
+	const_iterator end() const { return const_iterator(this, _size); }
+
+	/* append a default constructed element */
+	T &emplace_back() {
+		if ((_size >> ChunkBits) == _chunks.size())
+			_chunks.emplace_back(new T[chunk_size]);
+		size_t ix = _size++;
+		return (*this)[ix];
+	}
+
+	void clear() {
+		_chunks.clear();
+		_size = 0;
+	}
+
+private:
+
+	std::vector<std::unique_ptr<T[]>> _chunks;
+	size_t _size = 0;
+};
+
+#endif
@@ -0,0 +1,227 @@
+#include <algorithm>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <system_error>
+
+#include <cctype>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <afp/finder_info.h>
+
+#include "file_type_cache.h"
+#include "unique_resource.h"
+
+namespace {
+
+	std::string fold(std::string s) {
+		for (char &c : s) c = std::tolower(c);
+		return s;
+	}
+
+	void split(const std::string &path, std::string &dir, std::string &name) {
+		auto ix = path.find_last_of('/');
+		if (ix == path.npos) {
+			dir = ".";
+			name = path;
+		} else {
+			dir = path.substr(0, ix ? ix : 1);
+			name = path.substr(ix + 1);
+		}
+	}
+
+	uint32_t be16(const uint8_t *cp) { return (cp[0] << 8) | cp[1]; }
+	uint32_t be32(const uint8_t *cp) { return (cp[0] << 24) | (cp[1] << 16) | (cp[2] << 8) | cp[3]; }
+
+	/* finder type/creator to ProDOS, for the common encodings */
+	bool finder_prodos_type(const uint8_t *fi, uint16_t &file_type, uint32_t &aux_type) {
+		if (!std::memcmp(fi + 4, "pdos", 4)) {
+			if (fi[0] == 'p') {
+				file_type = fi[1];
+				aux_type = be16(fi + 2);
+				return true;
+			}
+			if (!std::memcmp(fi, "PSYS", 4)) { file_type = 0xff; aux_type = 0; return true; }
+			if (!std::memcmp(fi, "PS16", 4)) { file_type = 0xb3; aux_type = 0; return true; }
+		}
+		if (!std::memcmp(fi, "TEXT", 4)) { file_type = 0x04; aux_type = 0; return true; }
+		return false;
+	}
+
+	/* AppleDouble sidecar - ProDOS file info (entry 11), else finder info (entry 9) */
+	bool read_apple_double(const std::string &path, uint16_t &file_type, uint32_t &aux_type) {
+
+		int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+		if (fd < 0) return false;
+		auto close_fd = make_unique_resource(fd, close);
+
+		uint8_t header[26 + 12 * 16];
+		ssize_t n = pread(fd, header, sizeof(header), 0);
+		if (n < 26 || be32(header) != 0x00051607) return false;
+
+		unsigned count = std::min<size_t>(be16(header + 24), (n - 26) / 12);
+		bool ok = false;
+		for (unsigned i = 0; i < count; ++i) {
+			const uint8_t *e = header + 26 + i * 12;
+			uint32_t id = be32(e);
+			uint32_t offset = be32(e + 4);
+			uint32_t length = be32(e + 8);
+			uint8_t data[8];
+
+			if ((id != 9 && id != 11) || length < 8) continue;
+			if (pread(fd, data, 8, offset) != 8) continue;
+
+			if (id == 11) {
+				/* access, file type, aux type */
+				file_type = be16(data + 2);
+				aux_type = be32(data + 4);
+				return true;
+			}
+			if (finder_prodos_type(data, file_type, aux_type)) ok = true;
+		}
+		return ok;
+	}
+
+	bool list(const std::string &path, std::unordered_set<std::string> &names, std::unordered_set<std::string> &sidecars) {
+
+		DIR *dp = opendir(path.c_str());
+		if (!dp) return false;
+
+		while (struct dirent *e = readdir(dp)) {
+			std::string name(e->d_name);
+			if (name == "." || name == "..") continue;
+			/* AppleDouble sidecars are finder info, not inputs */
+			if (name.size() > 2 && name[0] == '.' && name[1] == '_') {
+				sidecars.emplace(name.substr(2));
+				continue;
+			}
+			names.emplace(std::move(name));
+		}
+		closedir(dp);
+		return true;
+	}
+}
+
+file_type_cache::dir_entry file_type_cache::read_directory(const std::string &path) {
+
+	dir_entry d;
+
+	/* not listable (eg, /dev/fd) - fall back to direct reads */
+	std::unordered_set<std::string> sidecars;
+	if (!list(path, d.names, sidecars)) return d;
+
+	for (const auto &name : d.names) d.folded.emplace(fold(name));
+	d.listed = true;
+
+	/* one pass over the sidecars */
+	for (const auto &name : sidecars) {
+		if (!d.names.count(name)) continue;
+		file_entry fe;
+		if (read_apple_double(path + "/._" + name, fe.file_type, fe.aux_type))
+			d.files.emplace(name, fe);
+	}
+	return d;
+}
+
+bool type_suffix(const std::string &path, uint16_t &file_type, uint32_t &aux_type) {
+
+	auto size = path.size();
+	if (size < 7 || path[size - 7] != '#') return false;
+
+	uint32_t value = 0;
+	for (auto i = size - 6; i < size; ++i) {
+		char c = path[i];
+		if (!std::isxdigit(c)) return false;
+		c |= 0x20;
+		value <<= 4;
+		value |= c <= '9' ? c - '0' : c - 'a' + 10;
+	}
+
+	file_type = value >> 16;
+	aux_type = value & 0xffff;
+	return true;
+}
+
+bool file_type_cache::get(const std::string &path, uint16_t &file_type, uint32_t &aux_type, std::error_code &ec) {
+
+	ec.clear();
+	if (type_suffix(path, file_type, aux_type)) return true;
+
+	std::string dname;
+	std::string name;
+	split(path, dname, name);
+
+	auto result = [&](const file_entry &fe) {
+		ec = fe.ec;
+		file_type = fe.file_type;
+		aux_type = fe.aux_type;
+		return !ec;
+	};
+
+	std::unique_lock<std::mutex> lock(_mutex);
+	auto diter = _cache.find(dname);
+	if (diter == _cache.end()) {
+		/* a cold directory doesn't hold up other lookups.  first one in wins */
+		lock.unlock();
+		dir_entry tmp = read_directory(dname);
+		lock.lock();
+		diter = _cache.emplace(dname, std::move(tmp)).first;
+	}
+
+	auto &d = diter->second;
+	auto iter = d.files.find(name);
+	if (iter != d.files.end()) return result(iter->second);
+
+	file_entry fe;
+	/* case-insensitive file systems may still find it */
+	if (d.listed && !d.names.count(name) && !d.folded.count(fold(name))) {
+		fe.ec = std::make_error_code(std::errc::no_such_file_or_directory);
+		d.files.emplace(name, fe);
+		return result(fe);
+	}
+
+	lock.unlock();
+	afp::finder_info fi;
+	if (fi.read(path, fe.ec)) {
+		fe.file_type = fi.prodos_file_type();
+		fe.aux_type = fi.prodos_aux_type();
+	}
+	lock.lock();
+
+	/* clear() may have dropped the directory meanwhile */
+	diter = _cache.find(dname);
+	if (diter == _cache.end()) return result(fe);
+	return result(diter->second.files.emplace(name, fe).first->second);
+}
+
+void file_type_cache::update(const std::string &path, uint16_t file_type, uint32_t aux_type) {
+
+	std::string dname;
+	std::string name;
+	split(path, dname, name);
+
+	std::lock_guard<std::mutex> lock(_mutex);
+	auto iter = _cache.find(dname);
+	if (iter == _cache.end()) return;
+
+	auto &d = iter->second;
+	file_entry fe;
+	fe.file_type = file_type;
+	fe.aux_type = aux_type;
+
+	d.folded.emplace(fold(name));
+	d.names.emplace(name);
+	d.files[name] = fe;
+}
+
+void file_type_cache::clear() {
+	std::lock_guard<std::mutex> lock(_mutex);
+	_cache.clear();
+}
@@ -0,0 +1,61 @@
+#ifndef file_type_cache_h
+#define file_type_cache_h
+
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <system_error>
+#include <unordered_map>
+#include <unordered_set>
+
+/*
+ * ProDOS file type / aux type lookups, cached per directory.
+ *
+ * The first lookup in a directory reads the directory listing once so
+ * lookups for files that don't exist (eg, LIB probing for every undefined
+ * symbol) cost nothing.  AppleDouble (._name) sidecars found in the listing
+ * are read in the same pass; other files' finder info is read at most once.
+ *
+ * Nothing is ever invalidated (except by update()), so a cache should live
+ * no longer than one link - see link_context.  Thread safe; directories and
+ * finder info are read without holding the lock.
+ */
+class file_type_cache {
+public:
+
+	bool get(const std::string &path, uint16_t &file_type, uint32_t &aux_type, std::error_code &ec);
+
+	/* record a type we just wrote (eg, the output file) */
+	void update(const std::string &path, uint16_t file_type, uint32_t aux_type);
+
+	void clear();
+
+private:
+
+	struct file_entry {
+		std::error_code ec;
+		uint16_t file_type = 0;
+		uint32_t aux_type = 0;
+	};
+
+	struct dir_entry {
+		bool listed = false;
+		std::unordered_set<std::string> names;
+		std::unordered_set<std::string> folded;
+		std::unordered_map<std::string, file_entry> files;
+	};
+
+	/* done without the lock, then published */
+	static dir_entry read_directory(const std::string &path);
+
+	std::unordered_map<std::string, dir_entry> _cache;
+	std::mutex _mutex;
+};
+
+/*
+ * CiderPress / NuLib2 style name suffix - file.rel#f80123 is type $f8, aux type $0123.
+ * file_type_cache::get() uses it without any file system access.
+ */
+bool type_suffix(const std::string &path, uint16_t &file_type, uint32_t &aux_type);
+
+#endif
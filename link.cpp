@@ -1,71 +1,55 @@
 /* c++17 */
 
 #include <algorithm>
+#include <atomic>
+#include <exception>
+#include <functional>
+#include <mutex>
 #include <numeric>
+#include <stdexcept>
 #include <string>
 #include <string_view>
 #include <system_error>
+#include <thread>
+#include <tuple>
 #include <unordered_map>
+#include <unordered_set>
 #include <utility>
 #include <vector>
 
 #include <cassert>
 #include <cerrno>
+#include <cstdarg>
 #include <cstdint>
 #include <cstdio>
+#include <cstdlib>
 #include <cstring>
 #include <ctime>
 
 #include <err.h>
-#include <sysexits.h>
+#include <fcntl.h>
 #include <unistd.h>
 
-#include <afp/finder_info.h>
-
-
 #include "mapped_file.h"
+#include "file_type_cache.h"
+#include "symbol_file.h"
 
 #include "omf.h"
 #include "rel.h"
+#include "rel_scan.h"
 #include "link.h"
 #include "script.h"
 
 void save_omf(const std::string &path, std::vector<omf::segment> &segments, bool compress, bool expressload, unsigned version = 2);
 void save_bin(const std::string &path, omf::segment &segment);
+void save_library(const std::string &path, std::vector<omf::library_member> &members);
 
 int set_file_type(const std::string &path, uint16_t file_type, uint32_t aux_type, std::error_code &ec);
 void set_file_type(const std::string &path, uint16_t file_type, uint32_t aux_type);
 
-/* since span isn't standard yet */
-typedef std::basic_string_view<uint8_t> byte_view;
-
-
-
-struct pending_reloc : public omf::reloc {
-	unsigned id = 0;
-};
-
-
-
-struct cookie {
-	std::string file;
-	std::vector<unsigned> remap;
-
-	uint32_t begin = 0;
-	uint32_t end = 0;
-};
-
-
 namespace {
 
-
-	std::unordered_map<std::string, unsigned> symbol_map;
-	std::vector<symbol> symbol_table;
-
-	std::vector<omf::segment> segments;
-	std::vector<std::vector<pending_reloc>> relocations;
-
-	std::unordered_map<std::string, uint32_t> file_types = {
+	const std::unordered_map<std::string, uint32_t> file_types = {
 
 		{ "NON", 0x00 },
 		{ "BAD", 0x01 },
@@ -150,52 +134,78 @@ seems like it might be nice for POS and LEN to be available in the command file,
  */
 
 
-namespace {
-	/* script related */
-
-	unsigned lkv = 1;
-	unsigned ver = 2;
-	unsigned ftype = 0xb3;
-	unsigned atype = 0x0000;
-//	unsigned kind = 0x0000;
-	unsigned org = 0x0000;
-
-	unsigned sav = 0;
-	unsigned lnk = 0;
-	bool end = false;
-	bool fas = false;
-	int ovr = OVR_OFF;
+[[noreturn]] static void throw_flag_error(const std::string &file, unsigned flag) {
+	char buffer[16];
+	snprintf(buffer, sizeof(buffer), "%02x", flag);
+	throw std::runtime_error(file + ": Unsupported flag: " + buffer);
+}
 
-	size_t pos_var = 0;
-	size_t len_var = 0;
+namespace {
+	/* input files stay mapped so later links (eg, in a batch) can reuse them */
+	/*
+	 * every input open by some link, so links running at the same time share
+	 * one copy.  the links own them (open_files) - an entry lives as long
+	 * as one of them still needs it.
+	 */
+	std::unordered_map<std::string, std::weak_ptr<const mapped_file>> mapped_files;
+	std::mutex mapped_files_mutex;
+
+	/* KBD */
+	std::mutex console_mutex;
+
+	const char *progname(void) {
+#ifdef __GLIBC__
+		return program_invocation_short_name;
+#else
+		return getprogname();
+#endif
+	}
+}
 
-	/* do/els/fin stuff.  32 do levels supported. */
-	uint32_t active_bits = 1;
-	bool active = true;
 
-	std::unordered_map<std::string, uint32_t> local_symbol_table; 
+link_context::link_context() :
+	type_cache(std::make_shared<file_type_cache>()),
+	relocations(arena.allocator<arena_vector<pending_reloc>>())
+{
+	read_threshold = mapped_file::read_threshold();
+	new_segment();
+}
 
-	std::string loadname;
+link_context::~link_context() {
+	if (prefix_fd >= 0) close(prefix_fd);
 }
 
+/* warnx(), to err_fp */
+void link_context::warning(const char *fmt, ...) const {
+	va_list ap;
+	va_start(ap, fmt);
+	if (err_fp == stderr) {
+		vwarnx(fmt, ap);
+	} else {
+		fprintf(err_fp, "%s: ", progname());
+		vfprintf(err_fp, fmt, ap);
+		fputc('\n', err_fp);
+	}
+	va_end(ap);
+}
 
-/* nb - pointer may be invalidated by next call */
-symbol *find_symbol(const std::string &name, bool insert) {
+symbol *link_context::find_symbol(const std::string &name, bool insert) {
 	
-	auto iter = symbol_map.find(name);
-	if (iter != symbol_map.end()) return &symbol_table[iter->second];
+	int ix = symbol_map.find(name);
+	if (ix >= 0) return &symbol_table[ix];
 	if (!insert) return nullptr;
 
 	unsigned id = symbol_table.size();
-	symbol_map.emplace(name, id);
+	symbol_map.insert(name, id);
 
+	symbol_values.emplace_back();
 	auto &rv = symbol_table.emplace_back();
 	rv.name = name;
 	rv.id = id;
 	return &rv;
 }
 
-void define(std::string name, uint32_t value, int type) {
+void link_context::define(std::string name, uint32_t value, int type) {
 
 	bool warn = false;
 	if (type & 4) {
@@ -210,50 +220,158 @@ void define(std::string name, uint32_t value, int type) {
 	if (type & 2) {
 		/* linker */
 		auto e = find_symbol(name, true);
-		if (e->defined) {
-			if (!e->absolute || e->value != value) {
+		auto &v = value_of(e);
+		if (v.defined) {
+			if (!v.absolute || v.value != value) {
 				warn = true;
 			}
 		} else {
-			e->absolute = true;
-			e->defined = true;
+			v.absolute = true;
+			v.defined = true;
+			v.value = value;
 			e->file = "-D";
-			e->value = value;
 		}
 	}
-	if (warn) warnx("duplicate symbol %s", name.c_str());
+	if (warn) warning("duplicate symbol %s", name.c_str());
 
 }
 
-void new_segment(bool reset = false) {
+/* start a new link - only -D, GEQ, etc. carry over */
+void link_context::reset_symbols(void) {
+
+	std::vector<std::pair<std::string, uint32_t>> tmp;
+	for (const auto &e : symbol_table) {
+		const auto &v = symbol_values[e.id];
+		if (!v.defined || !v.absolute || e.file != "-D") continue;
+		tmp.emplace_back(e.name, v.value);
+	}
+
+	symbol_table.clear();
+	symbol_values.clear();
+	symbol_map.clear();
+
+	for (const auto &e : tmp) {
+		auto x = find_symbol(e.first);
+		auto &xv = value_of(x);
+		xv.value = e.second;
+		xv.absolute = true;
+		xv.defined = true;
+		x->file = "-D";
+	}
+	loadname.clear();
+}
+
+void link_context::new_segment(bool reset) {
 
 	if (reset) {
 		segments.clear();
-		relocations.clear();
+		release_arena();
 		save_file.clear();
+		reset_symbols();
 	}
 
-	segments.emplace_back();
+	segments.emplace_back(arena.allocator<uint8_t>());
 	relocations.emplace_back();
 
 	segments.back().segnum = segments.size();
 	segments.back().kind = 4096; /* no special memory */
 	len_var = 0;
 	pos_var = 0;
+	stream_size = 0;
 }
 
 
-static void process_labels(byte_view &data, cookie &cookie) {
+/*
+ * check the REL dictionaries once, so process_labels, process_reloc and
+ * process_ds_err don't need to: every record is complete, relocations
+ * are within the code, and every external relocation has a label.
+ * returns the offset of the relocation dictionary terminator.
+ */
+static size_t validate_rel(const std::string &path, byte_view data, uint32_t code_size) {
+
+	auto invalid = [&](const char *what) {
+		throw std::runtime_error("Invalid REL file " + path + " (" + what + ")");
+	};
+
+	size_t end = rel_reloc_end(data.data(), data.size());
+	if (end >= data.size()) invalid("relocation dictionary");
+	/* shift records are 8 bytes */
+	for (size_t i = 0; i < end; i += 4) {
+		if (data[i] == FLAG_SHIFT) {
+			if (i + 4 >= end) invalid("relocation dictionary");
+			i += 4;
+		}
+	}
+
+	byte_view labels = data.substr(end + 1);
+	std::vector<uint32_t> index;
+	if (!rel_label_index(labels.data(), labels.size(), index)) invalid("label dictionary");
+
+	std::vector<bool> externals;
+	for (uint32_t x : index) {
+		unsigned flag = labels[x];
+		if ((flag & 0x1f) == 0) invalid("label dictionary");
+		switch (flag & ~0x1f) {
+			case SYMBOL_EXTERNAL: {
+				unsigned value = labels[x + 1 + (flag & 0x1f)] | (labels[x + 2 + (flag & 0x1f)] << 8);
+				value &= 0x7fff;
+				if (externals.size() < value + 1) externals.resize(value + 1);
+				externals[value] = true;
+				break;
+			}
+			case SYMBOL_ENTRY:
+			case SYMBOL_ENTRY+SYMBOL_ABSOLUTE:
+				break;
+			default:
+				throw_flag_error(path, flag);
+		}
+	}
+
+	for (size_t i = 0; i < end; i += 4) {
+		unsigned flag = data[i];
+		uint32_t offset = data[i + 1] | (data[i + 2] << 8);
+		unsigned x = data[i + 3];
+		unsigned size = 0;
+		bool external = false;
+
+		if (flag == FLAG_SHIFT) {
+			i += 4;
+			flag = data[i];
+			external = flag & SHIFT_EXTERNAL;
+			switch (flag & ~SHIFT_EXTERNAL) {
+				case SHIFT_16_1: size = 1; break;
+				case SHIFT_8_2: size = 2; break;
+				case SHIFT_8_1: size = 1; break;
+				default: throw_flag_error(path, flag);
+			}
+		} else {
+			external = flag & FLAG_EXTERNAL;
+			switch (flag & 0xf0) {
+				case 0x00: case 0x10: size = 1; break;
+				case 0x20: case 0x30: size = 3; break;
+				case 0x40: size = 1; break;
+				case 0x40 | FLAG_EXTERNAL: invalid("external high byte relocation"); break; /* x is the low byte */
+				case 0x80: case 0x90: size = 2; break;
+				case 0xa0: case 0xb0: size = 2; break;
+				case 0xc0: case 0xe0: continue; /* ds fill, err constraint */
+				default: throw_flag_error(path, flag);
+			}
+		}
+		if (offset + size > code_size) invalid("relocation offset");
+		if (external && (x >= externals.size() || !externals[x])) invalid("external reference");
+	}
+
+	return end;
+}
+
+void link_context::process_labels(byte_view &data, cookie &cookie, bool define) {
 
 	unsigned segnum = segments.back().segnum;
 	for(;;) {
-		assert(data.size());
 		unsigned flag = data[0];
 		if (flag == 0x00) return;
 
 		unsigned length = flag & 0x1f;
-		assert(length != 0);
-		assert(data.size() >= length + 4);
 
 		std::string name(data.data() + 1, data.data() + 1 + length);
 		data.remove_prefix(1 + length);
@@ -261,10 +379,11 @@ static void process_labels(byte_view &data, cookie &cookie) {
 		data.remove_prefix(3);
 
 		symbol *e = find_symbol(name);
+		auto &v = value_of(e);
 		switch (flag & ~0x1f) {
 			case SYMBOL_EXTERNAL:
 				/* map the unit symbol # to a global symbol # */
-				if (!(value & 0x8000)) e->exd = true;
+				if (!(value & 0x8000)) v.exd = true;
 
 				value &= 0x7fff;
 				if (cookie.remap.size() < value + 1)
@@ -274,45 +393,44 @@ static void process_labels(byte_view &data, cookie &cookie) {
 
 
 			case SYMBOL_ENTRY+SYMBOL_ABSOLUTE:
-				if (e->defined && e->absolute && e->value == value)
+				if (!define) break;
+				if (v.defined && v.absolute && v.value == value)
 					break; /* allow redef */
 
 			case SYMBOL_ENTRY:
-				if (e->defined) {
-					warnx("%s previously defined (%s)", e->name.c_str(), e->file.c_str());
+				if (!define) break;
+				if (v.defined) {
+					warning("%s previously defined (%s)", e->name.c_str(), e->file.c_str());
 					break;
 				}
-				e->defined = true;
+				v.defined = true;
+				v.segment = segnum;
 				e->file = cookie.file;
-				e->segment = segnum;
 				if (flag & SYMBOL_ABSOLUTE) {
-					e->absolute = true;
-					e->value = value;
+					v.absolute = true;
+					v.value = value;
 				} else {
-					e->absolute = false;
-					e->value = value - 0x8000 + cookie.begin;
+					v.absolute = false;
+					v.value = value - 0x8000 + cookie.begin;
 				}
 				break;
 			default:
-				errx(1, "%s: Unsupported flag: %02x\n", cookie.file.c_str(), flag);
+				throw_flag_error(cookie.file, flag);
 				break;
 		}
 	}
 }
 
 
-static void process_reloc(byte_view &data, cookie &cookie) {
+void link_context::process_reloc(byte_view &data, cookie &cookie) {
 
 	auto &seg = segments.back();
 	auto &pending = relocations.back();
 
 	for(;;) {
-		assert(data.size());
 		unsigned flag = data[0];
 		if (flag == 0x00) return;
 
-		assert(data.size() >= 4);
-
 		uint32_t offset = data[1] | (data[2] << 8);
 		unsigned x = data[3];
 		data.remove_prefix(4);
@@ -327,7 +445,6 @@ static void process_reloc(byte_view &data, cookie &cookie) {
 
 		if (flag == 0xff) {
 			/* shift */
-			assert(data.size() >= 4);
 			unsigned flag = data[0];
 			value = data[1] | (data[2] << 8) | (data[3] << 16);
 			value -= 0x8000;
@@ -346,7 +463,7 @@ static void process_reloc(byte_view &data, cookie &cookie) {
 					size = 1;
 					break;
 				default: /* bad */
-					errx(1, "%s: Unsupported flag: %02x\n", cookie.file.c_str(), flag);
+					throw_flag_error(cookie.file, flag);
 					break;
 			}
 			data.remove_prefix(4);
@@ -378,15 +495,14 @@ static void process_reloc(byte_view &data, cookie &cookie) {
 					break;
 				case 0xc0: /* ds fill */
 				case 0xe0: /* err constraint */
-					return;
+					/* handled by process_ds_err */
+					continue;
 				default: /* bad size */
-					errx(1, "%s: Unsupported flag: %02x\n", cookie.file.c_str(), flag);
+					throw_flag_error(cookie.file, flag);
 					break;
 			}
 			external = flag & 0x10;
 
-			assert(offset + size  <= cookie.end);
-
 
 			switch(size) {
 				case 3: value |= seg.data[offset+2] << 16;
@@ -401,7 +517,6 @@ static void process_reloc(byte_view &data, cookie &cookie) {
 				value <<= 8;
 				value += x; /* low-byte of address */
 				value -= 0x8000;
-				assert(!external);
 			}
 			if (size > 1) value -= 0x8000;
 
@@ -422,7 +537,6 @@ static void process_reloc(byte_view &data, cookie &cookie) {
 
 			if (external) {
 				pending_reloc r;
-				assert(x < cookie.remap.size());
 				r.id = cookie.remap[x];
 				r.size = 1;
 				r.offset = offset;
@@ -432,7 +546,6 @@ static void process_reloc(byte_view &data, cookie &cookie) {
 				symbol_table[r.id].count += 1;
 				pending.emplace_back(r);
 
-				pending.emplace_back(r);
 				r.offset++;
 				r.shift = 0;
 				pending.emplace_back(r);
@@ -451,14 +564,13 @@ static void process_reloc(byte_view &data, cookie &cookie) {
 				r.shift = 0;
 				seg.relocs.emplace_back(r);
 			}
-			return;
+			continue;
 		}
 
 		/* external resolutions are deferred for later */
 		if (external) {
 			/* x = local symbol # */
 			pending_reloc r;
-			assert(x < cookie.remap.size());
 			r.id = cookie.remap[x];
 			r.size = size;
 			r.offset = offset;
@@ -482,39 +594,39 @@ static void process_reloc(byte_view &data, cookie &cookie) {
 }
 
 
-static void process_ds_err(byte_view &data) {
+void link_context::process_ds_err(byte_view &data) {
 
 	auto &seg = segments.back();
 
+	/* --stream phase 1 only counts */
+	const bool scan = stream && !stream_data;
+
 	for(;;) {
-		assert(data.size());
 		unsigned flag = data[0];
 		if (flag == 0x00) return;
 
-		assert(data.size() >= 4);
-
 		if (flag == 0xcf) {
 			/* ds \ fill.  */
 			uint8_t c = data[3];
 
-			size_t sz = seg.data.size() & 0xff;
+			size_t sz = (scan ? stream_size : seg.data.size()) & 0xff;
 			if (sz) {
 
-				seg.data.insert(seg.data.end(), 0x100-sz, c);
+				if (scan) stream_size += 0x100 - sz;
+				else seg.data.insert(seg.data.end(), 0x100-sz, c);
 			}
 		}
-		if (flag == 0xef) {
+		if (flag == 0xef && !stream_data) {
 			/* err \ constraint */
-			size_t sz = seg.data.size() + org;
+			size_t sz = (scan ? stream_size : seg.data.size()) + org;
 			uint32_t addr = (data[1] << 0) | (data[2] << 8) | (data[3] << 16);
 			if (sz >= addr) {
-				warnx("Constraint at $%04x excess = $%04x", addr, static_cast<uint32_t>(sz - addr));
+				warning("Constraint at $%04x excess = $%04x", addr, static_cast<uint32_t>(sz - addr));
 			}
 		}
 
 
 		if (flag == 0xff) {
-			assert(data.size() >= 8);
 			data.remove_prefix(8);
 		} else {
 			data.remove_prefix(4);
@@ -522,63 +634,153 @@ static void process_ds_err(byte_view &data) {
 	}
 }
 
-static void process_unit(const std::string &path) {
+static std::string absolute_path(const std::string &path) {
 
-	cookie cookie;
-	/* skip over relocs, do symbols first */
+	if (!path.empty() && path.front() == '/') return path;
+
+	char *cp = getcwd(nullptr, 0);
+	if (!cp) return path;
+	std::string rv(cp);
+	free(cp);
+	rv.push_back('/');
+	rv.append(path);
+	return rv;
+}
+
+/* relative to the PFX directory, if any */
+std::string link_context::full_path(const std::string &path) const {
+	if (prefix.empty() || path.empty() || path.front() == '/') return path;
+	return prefix + path;
+}
+
+std::shared_ptr<const mapped_file> link_context::open_input(const std::string &path, std::error_code &ec) {
+
+	ec.clear();
+	std::string key = absolute_path(full_path(path));
 
-	if (verbose) printf("Linking %s\n", path.c_str());
+	auto lookup = [&]() -> std::shared_ptr<const mapped_file> {
+		auto iter = mapped_files.find(key);
+		return iter == mapped_files.end() ? nullptr : iter->second.lock();
+	};
+
+	std::shared_ptr<const mapped_file> mf;
+	{
+		std::lock_guard<std::mutex> lock(mapped_files_mutex);
+		mf = lookup();
+	}
+
+	if (!mf) {
+		/* not locked - other links keep opening files meanwhile */
+		auto tmp = std::make_shared<mapped_file>(prefix_fd < 0 ? AT_FDCWD : prefix_fd, path,
+			mapped_file::readonly, read_threshold, ec);
+		if (ec) return nullptr;
+
+		/* if another link opened it first, use that copy */
+		std::lock_guard<std::mutex> lock(mapped_files_mutex);
+		mf = lookup();
+		if (!mf) {
+			mapped_files[key] = tmp;
+			mf = std::move(tmp);
+		}
+	}
+	open_files.push_back(mf);
+	return mf;
+}
+
+std::shared_ptr<const mapped_file> link_context::open_unit(const std::string &path, uint16_t &file_type, uint32_t &aux_type, bool need_type, std::string *opened) {
 
 	std::error_code ec;
-	mapped_file mf(path, mapped_file::readonly, ec);
+	auto mf = open_input(path, ec);
+	if (opened) *opened = full_path(path);
+
+	/* file.rel#f80123 - if there's no such file, the suffix is just the type. */
+	if (ec == std::errc::no_such_file_or_directory && type_suffix(path, file_type, aux_type)) {
+		std::string base = path.substr(0, path.size() - 7);
+		mf = open_input(base, ec);
+		if (opened) *opened = full_path(base);
+	}
+
 	if (ec) {
-		errx(1, "Unable to open %s: %s", path.c_str(), ec.message().c_str());
+		throw input_error("Unable to open " + path + ": " + ec.message());
 	}
 
+	if (!type_cache->get(full_path(path), file_type, aux_type, ec) && need_type) {
+		throw input_error("Error reading filetype " + path + ": " + ec.message());
+	}
+	return mf;
+}
 
-	afp::finder_info fi;
+void link_context::add_unit(const std::string &path) {
 
-	fi.read(path, ec);
+	cookie cookie(arena.allocator<unsigned>());
+	/* skip over relocs, do symbols first */
 
-	if (ec) {
-		errx(1, "Error reading filetype %s: %s", path.c_str(), ec.message().c_str());
+	/* --stream phase 1 reads the labels, phase 2 the code and relocations */
+	const bool scan = stream && !stream_data;
+
+	if (verbose && !stream_data) fprintf(out_fp, "Linking %s\n", path.c_str());
+
+	uint16_t file_type = 0;
+	uint32_t offset = 0;
+	std::string opened;
+	auto mfp = open_unit(path, file_type, offset, true, &opened);
+	const mapped_file &mf = *mfp;
+	/* the file, not the name with its type suffix - make needs something that exists */
+	if (!stream_data) add_input(opened);
+
+	if (stream && (file_type == 0xb1 || file_type == 0xb2)) {
+		throw std::runtime_error(path + ": OMF objects and libraries can't be linked with --stream");
 	}
 
-	if (fi.prodos_file_type() != 0xf8) {
-		errx(1, "Wrong file type: %s", path.c_str());
+	if (file_type == 0xb1) {
+		process_object(path, mf.data(), mf.size());
+		return;
+	}
+
+	if (file_type == 0xb2) {
+		process_library(path, mf.data(), mf.size());
+		return;
+	}
+
+	if (file_type != 0xf8) {
+		throw std::runtime_error("Wrong file type: " + path);
 	}
 
-	uint32_t offset = fi.prodos_aux_type();
 	if (offset+2 > mf.size()) {
-		errx(1, "Invalid aux type %s", path.c_str());
+		throw std::runtime_error("Invalid aux type " + path);
 	}
 
+	byte_view data(mf.data() + offset, mf.size() - offset);
+
+	/* the decoders below trust the structure */
+	size_t n = validate_rel(path, data, offset);
+
 	auto &seg = segments.back();
 
-	cookie.begin = seg.data.size();
+	cookie.begin = scan ? stream_size : seg.data.size();
 	cookie.end = cookie.begin + offset;
-	cookie.file = path;
+	/* the map matches symbols to units by file - one spelling */
+	cookie.file = full_path(path);
+	if (!stream_data) add_map_unit(cookie.file, cookie.begin, cookie.end);
 
-	seg.data.insert(seg.data.end(), mf.data(), mf.data() + offset);
-	byte_view data(mf.data() + offset, mf.size() - offset);
+	if (scan) {
+		stream_units.push_back({ full_path(path), (unsigned)segments.size() - 1, cookie.begin });
+		stream_size += offset;
+	} else {
+		seg.data.insert(seg.data.end(), mf.data(), mf.data() + offset);
+	}
 
 
 	byte_view rr = data;
 	/* skip over the relocation records so we can process the labels first. */
 	/* this is so external references can use the global symbol id */
-	assert(data.size() >= 2);
-	for(;;) {
-		if (data[0] == 0) break;
-		assert(data.size() >= 6);
-		data.remove_prefix(4);
-	}
-	data.remove_prefix(1);
-	process_labels(data, cookie);
-	assert(data.size() == 1);
+	data.remove_prefix(n + 1);
+	process_labels(data, cookie, !stream_data);
 
-	/* now relocations */
-	process_ds_err(rr);
-	process_reloc(rr, cookie);
+	/* now relocations. process_ds_err advances its view, so give it a copy. */
+	byte_view ds = rr;
+	process_ds_err(ds);
+	if (!scan) process_reloc(rr, cookie);
 
 
 	// LEN support
@@ -590,57 +792,817 @@ static void process_unit(const std::string &path) {
 }
 
 
-static void import(const std::string &path, const std::string &name) {
+namespace {
 
-	std::error_code ec;
-	mapped_file mf(path, mapped_file::readonly, ec);
-	if (ec) {
-		errx(1, "Unable to open %s: %s", path.c_str(), ec.message().c_str());
+	/* labels referenced by the expressions in an OMF object */
+	void object_references(const std::string &path, const uint8_t *data, size_t size, std::vector<std::string> &refs) {
+
+		while (size) {
+			omf::segment_view sv;
+			size_t n = omf::read_segment(data, size, sv);
+			if (!n) throw std::runtime_error(path + ": Invalid OMF segment");
+
+			omf::record_reader rr(sv);
+			omf::record r;
+			while (rr.next(r)) {
+				const uint8_t *cp = r.data + 1;
+				switch(r.opcode) {
+					case omf::STRONG:
+						refs.emplace_back(rr.label(cp));
+						continue;
+					case omf::GEQU:
+					case omf::EQU:
+						rr.label(cp);
+						cp += rr.attr_size() + 2;
+						break;
+					case omf::EXPR:
+					case omf::ZEXPR:
+					case omf::BEXPR:
+					case omf::LEXPR:
+						cp += 1;
+						break;
+					case omf::RELEXPR:
+						cp += 1;
+						rr.number(cp);
+						break;
+					default:
+						continue;
+				}
+				for(;;) {
+					uint8_t op = *cp++;
+					if (op == 0x00) break;
+					if (op == 0x82 || op == 0x83) refs.emplace_back(rr.label(cp));
+					else if (op == 0x81 || op == 0x87) rr.number(cp);
+					else if (op == 0x84 || op == 0x85 || op == 0x86) rr.label(cp);
+				}
+			}
+			data += n;
+			size -= n;
+		}
+	}
+}
+
+size_t link_context::gc_units(std::vector<std::string> &units, const std::vector<std::string> &keep) {
+
+	struct node {
+		bool rel = false;
+		bool live = false;
+		uint32_t size = 0;
+		std::vector<std::string> refs;
+	};
+
+	std::vector<node> nodes(units.size());
+	std::unordered_map<std::string, unsigned> entries; /* symbol -> unit */
+
+	for (unsigned i = 0; i < units.size(); ++i) {
+		const std::string &path = units[i];
+		auto &n = nodes[i];
+
+		uint16_t file_type = 0;
+		uint32_t offset = 0;
+		auto mfp = open_unit(path, file_type, offset);
+		const mapped_file &mf = *mfp;
+
+		if (file_type == 0xb1) object_references(path, mf.data(), mf.size(), n.refs);
+		if (file_type != 0xf8) continue;
+
+		if (offset + 2 > mf.size()) {
+			throw std::runtime_error("Invalid aux type " + path);
+		}
+
+		n.rel = true;
+		n.size = offset;
+
+		/* skip the relocation dictionary */
+		byte_view data(mf.data() + offset, mf.size() - offset);
+		size_t end = rel_reloc_end(data.data(), data.size());
+		if (end >= data.size()) throw std::runtime_error("Invalid REL file " + path);
+		data.remove_prefix(end + 1);
+
+		std::vector<uint32_t> labels;
+		if (!rel_label_index(data.data(), data.size(), labels))
+			throw std::runtime_error("Invalid REL file " + path);
+
+		for (uint32_t x : labels) {
+			unsigned flag = data[x];
+			unsigned len = flag & 0x1f;
+
+			std::string name(data.begin() + x + 1, data.begin() + x + 1 + len);
+			if (flag & SYMBOL_EXTERNAL) n.refs.emplace_back(std::move(name));
+			else if (flag & SYMBOL_ENTRY) entries.emplace(std::move(name), i);
+		}
+	}
+
+	/* roots - the first unit, anything that isn't a REL unit, and --keep units or symbols */
+	std::vector<unsigned> work;
+	for (unsigned i = 0; i < units.size(); ++i) {
+		if (i == 0 || !nodes[i].rel || std::find(keep.begin(), keep.end(), units[i]) != keep.end())
+			work.push_back(i);
+	}
+	for (const auto &name : keep) {
+		auto iter = entries.find(name);
+		if (iter != entries.end()) work.push_back(iter->second);
 	}
 
+	while (!work.empty()) {
+		unsigned i = work.back();
+		work.pop_back();
+		if (nodes[i].live) continue;
+		nodes[i].live = true;
+		for (const auto &name : nodes[i].refs) {
+			auto iter = entries.find(name);
+			if (iter != entries.end()) work.push_back(iter->second);
+		}
+	}
+
+	size_t removed = 0;
+	unsigned count = 0;
+	std::vector<std::string> rv;
+	for (unsigned i = 0; i < units.size(); ++i) {
+		if (nodes[i].live) {
+			rv.emplace_back(std::move(units[i]));
+			continue;
+		}
+		if (verbose) fprintf(out_fp, "Removing %s ($%04x bytes)\n", units[i].c_str(), nodes[i].size);
+		removed += nodes[i].size;
+		++count;
+	}
+	units = std::move(rv);
+
+	fprintf(out_fp, "Removed %u unit%s, %zu bytes\n", count, count == 1 ? "" : "s", removed);
+	return removed;
+}
+
+void link_context::add_import(const std::string &path, const std::string &name) {
+
+	/* any file type (or none) */
+	uint16_t file_type = 0;
+	uint32_t aux_type = 0;
+	std::string opened;
+	auto mfp = open_unit(path, file_type, aux_type, false, &opened);
+	const mapped_file &mf = *mfp;
+
 	auto &seg = segments.back();
 
 	// check for duplicate label.
 	auto e = find_symbol(name);
-	if (e->defined) {
-		warnx("Duplicate symbol %s", name.c_str());
+	auto &v = value_of(e);
+	if (v.defined) {
+		warning("Duplicate symbol %s", name.c_str());
 		return;
 	}
 
-	e->file = path;
-	e->defined = true;
-	e->value = seg.data.size();
-	e->segment = segments.back().segnum;
+	/* --stream phase 1 only places it - finish_stream() reads it */
+	uint32_t begin = stream ? stream_size : seg.data.size();
 
-	seg.data.insert(seg.data.end(), mf.data(), mf.data() + mf.size());
+	e->file = full_path(path);
+	v.defined = true;
+	v.value = begin;
+	v.segment = segments.back().segnum;
+
+	add_input(opened);
+	add_map_unit(full_path(path), begin, begin + mf.size());
+	if (stream) {
+		stream_units.push_back({ full_path(path), (unsigned)segments.size() - 1, begin, (uint32_t)mf.size(), true });
+		stream_size += mf.size();
+	} else {
+		seg.data.insert(seg.data.end(), mf.data(), mf.data() + mf.size());
+	}
 
 	// LEN support
 	len_var = mf.size();
 	pos_var += mf.size();
 }
 
-static void resolve(bool allow_unresolved = false) {
+namespace {
+
+	/* an evaluated OMF expression */
+	struct omf_term {
+		enum { constant, relative, external } kind = constant;
+		unsigned id = 0; /* symbol, if external */
+		uint32_t value = 0; /* if relative, the offset in the current segment */
+		uint8_t shift = 0;
+	};
+
+	uint32_t omf_operator(unsigned op, uint32_t a, uint32_t b) {
+		switch(op) {
+			case 0x03: return a * b;
+			case 0x04: if (!b) throw std::runtime_error("divide by zero"); return a / b;
+			case 0x05: if (!b) throw std::runtime_error("divide by zero"); return a % b;
+			case 0x07: return (int32_t)b >= 0 ? a << b : a >> -(int32_t)b;
+			case 0x08: return a && b;
+			case 0x09: return a || b;
+			case 0x0a: return !a != !b;
+			case 0x0c: return a <= b;
+			case 0x0d: return a >= b;
+			case 0x0e: return a != b;
+			case 0x0f: return a < b;
+			case 0x10: return a > b;
+			case 0x11: return a == b;
+			case 0x12: return a & b;
+			case 0x13: return a | b;
+			case 0x14: return a ^ b;
+		}
+		throw std::runtime_error("bad OMF expression");
+	}
+
+	/*
+	 * Only what fits a relocation record is supported: label or
+	 * relative value, plus or minus a constant, optionally shifted right.
+	 * begin is where the object segment starts in the current segment.
+	 */
+	omf_term omf_expression(const omf::record_reader &rr, const uint8_t *&cp, uint32_t begin, uint32_t pc,
+		const std::function<omf_term(std::string_view)> &lookup) {
+
+		std::vector<omf_term> stack;
+
+		auto pop = [&](){
+			if (stack.empty()) throw std::runtime_error("bad OMF expression");
+			omf_term t = stack.back();
+			stack.pop_back();
+			return t;
+		};
+
+		for(;;) {
+			uint8_t op = *cp++;
+			switch(op) {
+				case 0x00: {
+					omf_term t = pop();
+					if (!stack.empty()) throw std::runtime_error("bad OMF expression");
+					return t;
+				}
+				case 0x80: {
+					omf_term t;
+					t.kind = omf_term::relative;
+					t.value = pc;
+					stack.push_back(t);
+					break;
+				}
+				case 0x81: {
+					omf_term t;
+					t.value = rr.number(cp);
+					stack.push_back(t);
+					break;
+				}
+				case 0x87: {
+					/* offset from the start of the object segment */
+					omf_term t;
+					t.kind = omf_term::relative;
+					t.value = begin + rr.number(cp);
+					stack.push_back(t);
+					break;
+				}
+				case 0x82:
+				case 0x83:
+					stack.push_back(lookup(rr.label(cp)));
+					break;
+
+				case 0x06:
+				case 0x0b:
+				case 0x15: {
+					omf_term t = pop();
+					if (t.kind != omf_term::constant)
+						throw std::runtime_error("unsupported OMF expression");
+					if (op == 0x06) t.value = -t.value;
+					if (op == 0x0b) t.value = !t.value;
+					if (op == 0x15) t.value = ~t.value;
+					stack.push_back(t);
+					break;
+				}
+
+				default: {
+					if (op > 0x15) throw std::runtime_error("unsupported OMF expression");
+
+					omf_term b = pop();
+					omf_term a = pop();
+
+					if (a.kind == omf_term::constant && b.kind == omf_term::constant) {
+						if (op == 0x01) a.value += b.value;
+						else if (op == 0x02) a.value -= b.value;
+						else a.value = omf_operator(op, a.value, b.value);
+						stack.push_back(a);
+						break;
+					}
+					if (a.shift || b.shift || b.kind == omf_term::external)
+						throw std::runtime_error("unsupported OMF expression");
+
+					if (op == 0x01 && a.kind == omf_term::constant) std::swap(a, b);
+
+					if (op == 0x01 && b.kind == omf_term::constant) {
+						a.value += b.value;
+					} else if (op == 0x02 && b.kind == omf_term::constant) {
+						a.value -= b.value;
+					} else if (op == 0x02 && a.kind == omf_term::relative && b.kind == omf_term::relative) {
+						a.kind = omf_term::constant;
+						a.value -= b.value;
+					} else if (op == 0x07 && b.kind == omf_term::constant && (int32_t)b.value < 0 && (int32_t)b.value >= -24) {
+						a.shift = b.value;
+					} else {
+						throw std::runtime_error("unsupported OMF expression");
+					}
+					stack.push_back(a);
+					break;
+				}
+			}
+		}
+	}
+
+	void store(arena_vector<uint8_t> &data, uint32_t offset, unsigned size, uint32_t value) {
+		while (size--) {
+			data[offset++] = value & 0xff;
+			value >>= 8;
+		}
+	}
+}
+
+/* OMF object file ($B1). every segment is appended to the current segment. */
+void link_context::process_object(const std::string &path, const uint8_t *data, size_t size) {
+
+	uint32_t total = 0;
+
+	while (size) {
+		omf::segment_view sv;
+		size_t n = omf::read_segment(data, size, sv);
+		if (!n) throw std::runtime_error(path + ": Invalid OMF segment");
+
+		total += process_object_segment(path, sv);
+
+		data += n;
+		size -= n;
+	}
+
+	len_var = total;
+	pos_var += total;
+}
+
+uint32_t link_context::process_object_segment(const std::string &path, const omf::segment_view &sv) {
+
+	auto &seg = segments.back();
+	auto &pending = relocations.back();
+
+	if (sv.alignment > 1) {
+		if (sv.alignment & (sv.alignment - 1))
+			throw std::runtime_error(path + ": Bad alignment");
+		size_t sz = seg.data.size() & (sv.alignment - 1);
+		if (sz) seg.data.insert(seg.data.end(), sv.alignment - sz, 0);
+	}
+
+	const uint32_t begin = seg.data.size();
+
+	/* LOCAL and EQU labels */
+	std::unordered_map<std::string_view, omf_term> locals;
+
+	auto lookup = [&](std::string_view name) {
+		auto iter = locals.find(name);
+		if (iter != locals.end()) return iter->second;
+
+		omf_term t;
+		const symbol *e = find_symbol(std::string(name));
+		const auto &v = value_of(e);
+		if (v.defined && v.absolute) {
+			t.value = v.value;
+		} else {
+			t.kind = omf_term::external;
+			t.id = e->id;
+		}
+		return t;
+	};
+
+	/* name the file in expression errors */
+	auto expression = [&](const omf::record_reader &rr, const uint8_t *&cp, uint32_t pc) {
+		try {
+			return omf_expression(rr, cp, begin, pc, lookup);
+		} catch (std::exception &ex) {
+			throw std::runtime_error(path + ": " + ex.what());
+		}
+	};
+
+	auto define_label = [&](std::string_view name, const omf_term &t, bool global) {
+		if (!global) {
+			locals[name] = t;
+			return;
+		}
+		if (t.kind == omf_term::external || t.shift)
+			throw std::runtime_error(path + ": unsupported label " + std::string(name));
+
+		symbol *e = find_symbol(std::string(name));
+		auto &v = value_of(e);
+		if (v.defined) {
+			if (!(v.absolute && t.kind == omf_term::constant && v.value == t.value))
+				warning("%s previously defined (%s)", e->name.c_str(), e->file.c_str());
+			return;
+		}
+		e->file = full_path(path);
+		v.defined = true;
+		v.segment = seg.segnum;
+		v.absolute = t.kind == omf_term::constant;
+		v.value = t.value;
+	};
+
+	/* pass 1 - labels. pass 2 - data and relocations. */
+	uint32_t pc = 0;
+	for (int pass = 1; pass <= 2; ++pass) {
+
+		omf::record_reader rr(sv);
+		omf::record r;
+
+		pc = 0;
+		while (rr.next(r)) {
+			const uint8_t *cp = r.data + 1;
+
+			switch(r.opcode) {
+				case omf::LCONST: {
+					uint32_t n = rr.number(cp);
+					if (pass == 2) seg.data.insert(seg.data.end(), cp, cp + n);
+					pc += n;
+					break;
+				}
+
+				case omf::DS: {
+					uint32_t n = rr.number(cp);
+					if (pass == 2) seg.data.insert(seg.data.end(), n, 0);
+					pc += n;
+					break;
+				}
+
+				case omf::ALIGN: {
+					uint32_t n = rr.number(cp);
+					if (n & (n - 1)) throw std::runtime_error(path + ": Bad alignment");
+					uint32_t sz = n ? (n - (pc & (n - 1))) & (n - 1) : 0;
+					if (pass == 2) seg.data.insert(seg.data.end(), sz, 0);
+					pc += sz;
+					break;
+				}
+
+				case omf::GLOBAL:
+				case omf::LOCAL:
+					if (pass == 1) {
+						std::string_view name = rr.label(cp);
+						/* length attr, type attr, private */
+						bool global = r.opcode == omf::GLOBAL && !cp[rr.attr_size() + 1];
+						omf_term t;
+						t.kind = omf_term::relative;
+						t.value = begin + pc;
+						define_label(name, t, global);
+					}
+					break;
+
+				case omf::GEQU:
+				case omf::EQU:
+					if (pass == 1) {
+						std::string_view name = rr.label(cp);
+						bool global = r.opcode == omf::GEQU && !cp[rr.attr_size() + 1];
+						cp += rr.attr_size() + 2;
+						omf_term t = expression(rr, cp, begin + pc);
+						define_label(name, t, global);
+					}
+					break;
+
+				case omf::EXPR:
+				case omf::ZEXPR:
+				case omf::BEXPR:
+				case omf::LEXPR:
+				case omf::RELEXPR: {
+					unsigned size = *cp++;
+					uint32_t disp = 0;
+					if (r.opcode == omf::RELEXPR) disp = rr.number(cp);
+
+					if (pass == 2) {
+						uint32_t offset = seg.data.size();
+						seg.data.insert(seg.data.end(), size, 0);
+
+						omf_term t = expression(rr, cp, offset);
+
+						if (r.opcode == omf::RELEXPR) {
+							/* pc-relative, eg BRL */
+							if (t.shift || t.kind == omf_term::constant)
+								throw std::runtime_error(path + ": unsupported relative expression");
+							t.value -= offset + disp;
+							if (t.kind == omf_term::relative) {
+								store(seg.data, offset, size, t.value);
+								break;
+							}
+						}
+
+						switch(t.kind) {
+							case omf_term::constant:
+								store(seg.data, offset, size, t.value);
+								break;
+							case omf_term::relative: {
+								omf::reloc rel;
+								rel.size = size;
+								rel.shift = t.shift;
+								rel.offset = offset;
+								rel.value = t.value;
+								seg.relocs.emplace_back(rel);
+								break;
+							}
+							case omf_term::external: {
+								pending_reloc rel;
+								rel.id = t.id;
+								rel.size = size;
+								rel.shift = t.shift;
+								rel.offset = offset;
+								rel.value = t.value;
+								rel.relative = r.opcode == omf::RELEXPR;
+								symbol_table[rel.id].count += 1;
+								pending.emplace_back(rel);
+								break;
+							}
+						}
+					}
+					pc += size;
+					break;
+				}
+
+				case omf::STRONG:
+					if (pass == 2) find_symbol(std::string(rr.label(cp)))->count += 1;
+					break;
+
+				case omf::USING:
+				case omf::ENTRY:
+					break;
+
+				case omf::ORG:
+				case omf::MEM:
+				case omf::RELOC:
+				case omf::INTERSEG:
+				case omf::cRELOC:
+				case omf::cINTERSEG:
+				case omf::SUPER:
+					throw std::runtime_error(path + ": Unsupported OMF record");
+
+				default:
+					/* CONST */
+					if (pass == 2) seg.data.insert(seg.data.end(), cp, cp + r.opcode);
+					pc += r.opcode;
+					break;
+			}
+		}
+	}
+
+	add_map_unit(full_path(path), begin, begin + pc);
+	return pc;
+}
+
+namespace {
+
+	/*
+	 * what the writer will use for a record - super if SUPER records are
+	 * written, bias 1 if ExpressLoad renumbers the segments.
+	 */
+	struct reloc_format {
+		bool super = false;
+		unsigned bias = 0;
+	};
+
+	/* as omf::writer - version 1 has neither */
+	reloc_format writer_format(bool compress, bool express, unsigned version) {
+		reloc_format f;
+		f.super = compress && version != 1;
+		f.bias = express && version != 1 ? 1 : 0;
+		return f;
+	}
+
+	bool super_encodable(const omf::reloc &r, unsigned segnum, reloc_format f) {
+		return f.super && omf::super_type(r, segnum + f.bias) >= 0;
+	}
+
+	bool super_encodable(const omf::interseg &r, unsigned segnum, reloc_format f) {
+		return f.super && omf::super_type(r, r.segment + f.bias) >= 0;
+	}
+
+	/* approximate bytes a record costs in the relocation dictionary (see add_relocs) */
+	unsigned reloc_cost(const omf::reloc &r, unsigned segnum, reloc_format f) {
+		if (!r.can_compress()) return 11;
+		if (super_encodable(r, segnum, f)) return 1;
+		return 7;
+	}
+
+	unsigned reloc_cost(const omf::interseg &r, unsigned segnum, reloc_format f) {
+		if (!r.can_compress()) return 15;
+		if (super_encodable(r, segnum, f)) return 1;
+		return 8;
+	}
+
+	auto reloc_key(const omf::reloc &r) {
+		return std::make_tuple(r.offset, r.size, r.shift, r.value);
+	}
+
+	auto reloc_key(const omf::interseg &r) {
+		return std::make_tuple(r.offset, r.size, r.shift, r.file, r.segment, r.segment_offset);
+	}
+
+	/* sort by offset and remove exact duplicates.  returns the bytes saved. */
+	template<class T>
+	unsigned dedup(arena_vector<T> &v, unsigned segnum, reloc_format f, unsigned &count) {
+
+		std::sort(v.begin(), v.end(), [](const T &a, const T &b){
+			return reloc_key(a) < reloc_key(b);
+		});
+
+		unsigned saved = 0;
+		auto iter = std::unique(v.begin(), v.end(), [&](const T &a, const T &b){
+			if (reloc_key(a) != reloc_key(b)) return false;
+			saved += reloc_cost(b, segnum, f);
+			++count;
+			return true;
+		});
+		v.erase(iter, v.end());
+		return saved;
+	}
+}
+
+/*
+ * merge duplicate relocation records and make sure no two
+ * records patch the same byte.
+ */
+void link_context::canonicalize_relocs(omf::segment &seg) {
+
+	reloc_format f = writer_format(compress, express, ver);
+	unsigned count = 0;
+	unsigned saved = 0;
+
+	saved += dedup(seg.relocs, seg.segnum, f, count);
+	saved += dedup(seg.intersegs, seg.segnum, f, count);
+
+	/* merge the two (sorted) lists to check for overlaps */
+	uint32_t next = 0;
+	auto iter1 = seg.relocs.begin();
+	auto iter2 = seg.intersegs.begin();
+	while (iter1 != seg.relocs.end() || iter2 != seg.intersegs.end()) {
+		uint32_t offset, size;
+		if (iter2 == seg.intersegs.end() || (iter1 != seg.relocs.end() && iter1->offset <= iter2->offset)) {
+			offset = iter1->offset;
+			size = iter1->size;
+			++iter1;
+		} else {
+			offset = iter2->offset;
+			size = iter2->size;
+			++iter2;
+		}
+		if (offset < next) {
+			char buffer[64];
+			snprintf(buffer, sizeof(buffer), "overlapping relocations at $%04x", offset);
+			throw std::runtime_error(buffer);
+		}
+		next = offset + size;
+	}
+
+	if (count && verbose)
+		fprintf(out_fp, "Segment %u: removed %u duplicate relocation%s (%u bytes)\n",
+			seg.segnum, count, count == 1 ? "" : "s", saved);
+}
+
+/*
+ * split a code segment that doesn't fit in a bank at unit boundaries.
+ * the extra pieces are added as new segments; relocations that now cross
+ * pieces become intersegs.  called before external references are resolved.
+ */
+void link_context::split_segment(unsigned ix) {
+
+	if ((segments[ix].kind & 0x1f) != 0x00 || segments[ix].data.size() <= 0xffff) return;
+
+	const unsigned segnum = segments[ix].segnum;
+	const uint32_t size = segments[ix].data.size();
+
+	std::vector<uint32_t> unit_begin;
+	for (const auto &u : map_units) {
+		if (u.segment == segnum) unit_begin.push_back(u.begin);
+	}
+	std::sort(unit_begin.begin(), unit_begin.end());
+
+	/* cuts[i] = start of piece i */
+	std::vector<uint32_t> cuts = { 0 };
+	for (size_t i = 0; i < unit_begin.size(); ++i) {
+		uint32_t end = i + 1 < unit_begin.size() ? unit_begin[i + 1] : size;
+		if (end - cuts.back() > 0xffff) {
+			if (unit_begin[i] == cuts.back())
+				throw std::runtime_error("code exceeds bank (unit larger than 64K)");
+			cuts.push_back(unit_begin[i]);
+			if (end - cuts.back() > 0xffff)
+				throw std::runtime_error("code exceeds bank (unit larger than 64K)");
+		}
+	}
+	if (size - cuts.back() > 0xffff || cuts.size() == 1)
+		throw std::runtime_error("code exceeds bank");
+
+	auto piece = [&](uint32_t offset) -> unsigned {
+		return std::upper_bound(cuts.begin(), cuts.end(), offset) - cuts.begin() - 1;
+	};
+
+	/* segment numbers for each piece */
+	std::vector<unsigned> numbers = { segnum };
+	for (size_t i = 1; i < cuts.size(); ++i) {
+		const auto &seg = segments[ix];
+		omf::segment tmp(arena.allocator<uint8_t>());
+		tmp.segnum = segments.size() + 1;
+		tmp.kind = seg.kind;
+		tmp.alignment = seg.alignment;
+		tmp.loadname = seg.loadname;
+		tmp.segname = seg.segname + "." + std::to_string(i + 1);
+
+		uint32_t end = i + 1 < cuts.size() ? cuts[i + 1] : size;
+		tmp.data.assign(seg.data.begin() + cuts[i], seg.data.begin() + end);
+
+		numbers.push_back(tmp.segnum);
+		segments.emplace_back(std::move(tmp));
+		relocations.emplace_back();
+		if (verbose) fprintf(out_fp, "Segment %u: split at $%06x into segment %u\n", segnum, cuts[i], numbers.back());
+	}
+
+	auto &seg = segments[ix];
+
+	arena_vector<omf::reloc> relocs(arena.allocator<omf::reloc>());
+	relocs.swap(seg.relocs);
+	for (auto r : relocs) {
+		unsigned a = piece(r.offset);
+		unsigned b = piece(std::min(r.value, size - 1));
+		auto &dest = segments[numbers[a] - 1];
+		r.offset -= cuts[a];
+		if (a == b) {
+			r.value -= cuts[b];
+			dest.relocs.push_back(r);
+		} else {
+			omf::interseg inter;
+			inter.size = r.size;
+			inter.shift = r.shift;
+			inter.offset = r.offset;
+			inter.segment = numbers[b];
+			inter.segment_offset = r.value - cuts[b];
+			dest.intersegs.push_back(inter);
+		}
+	}
+
+	arena_vector<pending_reloc> pending(arena.allocator<pending_reloc>());
+	pending.swap(relocations[ix]);
+	for (auto r : pending) {
+		unsigned a = piece(r.offset);
+		r.offset -= cuts[a];
+		relocations[numbers[a] - 1].push_back(r);
+	}
+
+	for (auto &v : symbol_values) {
+		if (!v.defined || v.absolute || v.segment != segnum) continue;
+		unsigned b = piece(std::min(v.value, size - 1));
+		v.segment = numbers[b];
+		v.value -= cuts[b];
+	}
+
+	for (auto &u : map_units) {
+		if (u.segment != segnum) continue;
+		unsigned a = piece(u.begin);
+		u.segment = numbers[a];
+		u.begin -= cuts[a];
+		u.end -= cuts[a];
+	}
+
+	seg.data.resize(cuts[1]);
+}
+
+void link_context::resolve(bool allow_unresolved) {
+
+	/* not LKV 0 (binary) or objects (LKV 3, library members) - those are one segment */
+	if (split && (lkv == 1 || lkv == 2) && !allow_unresolved) {
+		for (unsigned ix = 0, n = segments.size(); ix < n; ++ix) split_segment(ix);
+	}
 
 	for (unsigned ix = 0; ix < segments.size(); ++ix) {
 
 		auto &seg = segments[ix];
 		auto &pending = relocations[ix];
 
-		std::vector<pending_reloc> unresolved;
+		arena_vector<pending_reloc> unresolved(arena.allocator<pending_reloc>());
 
-		if ((seg.kind & 0x0001) == 0x0001 && seg.data.size() > 65535) {
+		/* kind type 0 = code. LKV 0 binaries aren't limited */
+		if (lkv != 0 && (seg.kind & 0x1f) == 0x00 && seg.data.size() > 65535) {
 			throw std::runtime_error("code exceeds bank");
 		}
 
 		for (auto &r : pending) {
-			assert(r.id < symbol_map.size());
-			const auto &e = symbol_table[r.id];
+			assert(r.id < symbol_values.size());
+			const auto &e = symbol_values[r.id];
 
 			if (!e.defined) {
 				if (allow_unresolved) {
 					unresolved.emplace_back(std::move(r));
 				} else {
-					warnx("%s is not defined", e.name.c_str());
+					warning("%s is not defined", symbol_table[r.id].name.c_str());
+				}
+				continue;
+			}
+
+			/* pc-relative (OMF RELEXPR) - r.value already has the pc subtracted */
+			if (r.relative) {
+				if (!e.absolute && e.segment != seg.segnum)
+					throw std::runtime_error("relative reference to " + symbol_table[r.id].name + " in another segment");
+
+				uint32_t value = e.value + r.value;
+				unsigned offset = r.offset;
+				unsigned size = r.size;
+				while (size--) {
+					seg.data[offset++] = value & 0xff;
+					value >>= 8;
 				}
 				continue;
 			}
@@ -677,14 +1639,7 @@ static void resolve(bool allow_unresolved = false) {
 		}
 		pending.clear();
 
-		/* sort them */
-		std::sort(seg.relocs.begin(), seg.relocs.end(), [](const auto &a, const auto &b){
-			return a.offset < b.offset;
-		});
-
-		std::sort(seg.intersegs.begin(), seg.intersegs.end(), [](const auto &a, const auto &b){
-			return a.offset < b.offset;
-		});
+		canonicalize_relocs(seg);
 
 		std::sort(unresolved.begin(), unresolved.end(), [](const auto &a, const auto &b){
 			return a.offset < b.offset;
@@ -694,7 +1649,7 @@ static void resolve(bool allow_unresolved = false) {
 }
 
 
-static void print_symbols2(const std::vector<size_t> &ix) {
+void link_context::print_symbols2(const std::vector<size_t> &ix) {
 
 	size_t len = 8;
 	for (const auto &e : symbol_table) {
@@ -703,16 +1658,40 @@ static void print_symbols2(const std::vector<size_t> &ix) {
 
 	for (auto i : ix) {
 		const auto &e = symbol_table[i];
+		const auto &v = symbol_values[i];
 		char q = ' ';
 		if (!e.count) q = '?';
-		if (!e.defined) q = '!';
-		uint32_t value = e.value;
-		if (!e.absolute) value += (e.segment << 16);
-		fprintf(stdout, "%c %-*s=$%06x\n", q, (int)len, e.name.c_str(), value);
+		if (!v.defined) q = '!';
+		uint32_t value = v.value;
+		if (!v.absolute) value += (v.segment << 16);
+		fprintf(out_fp, "%c %-*s=$%06x\n", q, (int)len, e.name.c_str(), value);
 	}	
 }
 
-static void print_symbols(void) { 
+/* binary symbol file, for -D@file */
+void link_context::save_symbols(const std::string &path) {
+
+	std::vector<symbol_file_entry> entries;
+	for (const auto &e : symbol_table) {
+		const auto &v = symbol_values[e.id];
+		if (!v.defined) continue;
+		symbol_file_entry x;
+		x.name = e.name;
+		x.value = v.value;
+		x.segment = v.absolute ? 0 : v.segment;
+		x.absolute = v.absolute;
+		entries.push_back(x);
+	}
+
+	if (verbose) fprintf(out_fp, "Saving %s\n", path.c_str());
+	try {
+		save_symbol_file(path, entries);
+	} catch (std::exception &ex) {
+		throw std::runtime_error(path + ": " + ex.what());
+	}
+}
+
+void link_context::print_symbols(void) {
 
 	if (symbol_table.empty()) return;
 
@@ -720,7 +1699,7 @@ static void print_symbols(void) {
 	std::iota(ix.begin(), ix.end(), 0);
 
 	/* alpha */
-	fputs("\nSymbol table, alphabetical order:\n", stdout);
+	fputs("\nSymbol table, alphabetical order:\n", out_fp);
 
 
 	std::sort(ix.begin(), ix.end(), [&](const size_t a, const size_t b){
@@ -740,13 +1719,13 @@ static void print_symbols(void) {
 
 	std::iota(ix.begin(), ix.end(), 0);
 
-	fputs("\nSymbol table, numerical order:\n", stdout);
+	fputs("\nSymbol table, numerical order:\n", out_fp);
 
 	/* numeric, factoring in segment #, absolute first */
 
 	std::sort(ix.begin(), ix.end(), [&](const size_t a, const size_t b){
-		const symbol &aa = symbol_table[a];
-		const symbol &bb = symbol_table[b];
+		const symbol_value &aa = symbol_values[a];
+		const symbol_value &bb = symbol_values[b];
 
 			/* absolute have a segment # of 0 so will sort first */
 			auto aaa = std::make_pair(aa.segment, aa.value);
@@ -767,67 +1746,375 @@ static void print_symbols(void) {
 		});
 #endif
 	print_symbols2(ix);
-	fputs("\n", stdout);
+	fputs("\n", out_fp);
 }
 
 
-static void check_exd(void) {
+void link_context::check_exd(void) {
 
-	for (const auto &e : symbol_table) {
+	for (size_t i = 0; i < symbol_values.size(); ++i) {
+		const auto &e = symbol_values[i];
 
 		if (!e.exd) continue;
 		if (!e.defined) continue;
 		if (e.absolute && e.value < 0x0100) continue;
 		if (!e.absolute && lkv == 0 && (e.value + org) < 0x0100) continue;
 
-		warnx("%s defined as direct page", e.name.c_str());
+		warning("%s defined as direct page", symbol_table[i].name.c_str());
+	}
+}
+
+
+static void forget_file(const std::string &path) {
+	std::lock_guard<std::mutex> lock(mapped_files_mutex);
+	mapped_files.erase(absolute_path(path));
+}
+
+void link_context::write_omf(const std::string &path) {
+	outputs.push_back(path);
+	forget_file(path);
+	save_omf(path, segments, compress, express, ver);
+	set_file_type(path, ftype, atype);
+	type_cache->update(path, ftype, atype);
+}
+
+void link_context::write_bin(const std::string &path) {
+	outputs.push_back(path);
+	forget_file(path);
+	save_bin(path, segments.back());
+	set_file_type(path, ftype, atype);
+	type_cache->update(path, ftype, atype);
+}
+
+/*
+ * LKV 2 layout report.  Builds a unit reference graph from the relocation
+ * and interseg records and greedily suggests unit moves that turn intersegs
+ * into (smaller) intra-segment relocations, within the 64K bank limit.
+ */
+void link_context::suggest_layout(void) {
+
+	if (segments.size() < 2) return;
+
+	/* units by segment, sorted by offset */
+	std::vector<map_unit> units(map_units);
+	std::sort(units.begin(), units.end(), [](const map_unit &a, const map_unit &b){
+		return std::make_pair(a.segment, a.begin) < std::make_pair(b.segment, b.begin);
+	});
+
+	auto find_unit = [&](unsigned segment, uint32_t offset) -> int {
+		auto iter = std::upper_bound(units.begin(), units.end(), std::make_pair(segment, offset),
+			[](const std::pair<unsigned, uint32_t> &key, const map_unit &u){
+				return key < std::make_pair(u.segment, u.begin);
+			});
+		if (iter == units.begin()) return -1;
+		--iter;
+		if (iter->segment != segment || offset >= iter->end) return -1;
+		return iter - units.begin();
+	};
+
+	const reloc_format f = writer_format(compress, express, ver);
+
+	/*
+	 * edge weights are (relocation dictionary bytes, references) saved by
+	 * having both units in one segment - bytes first, then fewer intersegs.
+	 */
+	typedef std::pair<int, int> weight_t;
+	std::vector<std::unordered_map<unsigned, weight_t>> edges(units.size());
+	unsigned intersegs = 0;
+	unsigned super = 0;
+
+	auto add_edge = [&](int a, int b, int bytes) {
+		if (a < 0 || b < 0 || a == b) return;
+		for (auto &w : { &edges[a][b], &edges[b][a] }) {
+			w->first += bytes;
+			w->second += 1;
+		}
+	};
+
+	for (const auto &seg : segments) {
+		for (const auto &r : seg.relocs) {
+			omf::interseg x;
+			x.size = r.size;
+			x.shift = r.shift;
+			x.offset = r.offset;
+			x.segment = seg.segnum;
+			x.segment_offset = r.value;
+			int weight = reloc_cost(x, seg.segnum, f) - reloc_cost(r, seg.segnum, f);
+			add_edge(find_unit(seg.segnum, r.offset), find_unit(seg.segnum, r.value), weight);
+		}
+		for (const auto &r : seg.intersegs) {
+			++intersegs;
+			if (super_encodable(r, seg.segnum, f)) ++super;
+
+			omf::reloc x;
+			x.size = r.size;
+			x.shift = r.shift;
+			x.offset = r.offset;
+			x.value = r.segment_offset;
+			int weight = reloc_cost(r, seg.segnum, f) - reloc_cost(x, r.segment, f);
+			add_edge(find_unit(seg.segnum, r.offset), find_unit(r.segment, r.segment_offset), weight);
+		}
+	}
+
+	fprintf(out_fp, "Layout: %u intersegs, %u SUPER encodable\n", intersegs, super);
+
+	std::vector<unsigned> where(units.size());
+	std::unordered_map<unsigned, uint32_t> sizes;
+	std::unordered_map<unsigned, bool> code;
+	for (unsigned i = 0; i < units.size(); ++i) where[i] = units[i].segment;
+	for (const auto &seg : segments) {
+		code[seg.segnum] = (seg.kind & 0x1f) == 0;
+		sizes[seg.segnum] = seg.data.size();
+	}
+
+	/* each pass moves the unit with the best gain (in bytes). bounded, since gains only shrink */
+	unsigned moved = 0;
+	for (unsigned pass = 0; pass < units.size(); ++pass) {
+		weight_t best_gain;
+		unsigned best_unit = 0;
+		unsigned best_segment = 0;
+
+		for (unsigned i = 0; i < units.size(); ++i) {
+			std::unordered_map<unsigned, weight_t> weight; /* segment -> savings */
+			for (const auto &kv : edges[i]) {
+				auto &w = weight[where[kv.first]];
+				w.first += kv.second.first;
+				w.second += kv.second.second;
+			}
+
+			weight_t here = weight[where[i]];
+			uint32_t size = units[i].end - units[i].begin;
+			for (const auto &kv : weight) {
+				unsigned s = kv.first;
+				if (s == where[i]) continue;
+				if (code[s] && sizes[s] + size > 0xffff) continue;
+				weight_t gain(kv.second.first - here.first, kv.second.second - here.second);
+				if (gain > best_gain) {
+					best_gain = gain;
+					best_unit = i;
+					best_segment = s;
+				}
+			}
+		}
+		if (best_gain <= weight_t()) break;
+
+		const auto &u = units[best_unit];
+		uint32_t size = u.end - u.begin;
+		fprintf(out_fp, "  move %s from segment %u to segment %u: %d bytes smaller, %d fewer intersegs\n",
+			u.file.c_str(), where[best_unit], best_segment, best_gain.first, best_gain.second);
+
+		sizes[where[best_unit]] -= size;
+		sizes[best_segment] += size;
+		where[best_unit] = best_segment;
+		++moved;
 	}
+	if (!moved) fprintf(out_fp, "  no improvements found\n");
 }
 
+/*
+ * SUPER_INTERSEG13..36 (2 byte, optionally >>16) only work for segments 1-12,
+ * (after ExpressLoad adds 1).  Renumber segments 2+ so the ones with the most
+ * such references come first.  Segment 1 is where execution starts, so it stays.
+ */
+void link_context::renumber_segments(void) {
+
+	if (segments.size() < 3) return;
+
+	unsigned limit = express && ver != 1 ? 11 : 12;
+
+	std::vector<unsigned> weight(segments.size() + 1);
+	for (const auto &seg : segments) {
+		for (const auto &r : seg.intersegs) {
+			if (r.size == 2 && (r.shift == 0 || r.shift == 0xf0)) weight[r.segment] += 1;
+		}
+		for (const auto &r : seg.relocs) {
+			if (r.size == 2 && r.shift == 0xf0) weight[seg.segnum] += 1;
+		}
+	}
+
+	auto encodable = [&](){
+		unsigned n = 0;
+		for (unsigned i = 1; i <= segments.size(); ++i)
+			if (segments[i-1].segnum <= limit) n += weight[i];
+		return n;
+	};
+	unsigned before = encodable();
+
+	std::vector<unsigned> order(segments.size());
+	std::iota(order.begin(), order.end(), 0);
+	std::stable_sort(order.begin() + 1, order.end(), [&](unsigned a, unsigned b){
+		return weight[a + 1] > weight[b + 1];
+	});
+
+	/* old segment number -> new segment number */
+	std::vector<unsigned> remap(segments.size() + 1);
+	for (unsigned i = 0; i < order.size(); ++i) remap[order[i] + 1] = i + 1;
+
+	std::vector<omf::segment> tmp_segments;
+	decltype(relocations) tmp_relocations(relocations.get_allocator());
+	for (unsigned ix : order) {
+		tmp_segments.emplace_back(std::move(segments[ix]));
+		tmp_relocations.emplace_back(std::move(relocations[ix]));
+	}
+	segments = std::move(tmp_segments);
+	relocations = std::move(tmp_relocations);
+
+	for (auto &seg : segments) {
+		if (verbose && seg.segnum != remap[seg.segnum])
+			fprintf(out_fp, "Segment %u: %s renumbered to %u\n", seg.segnum, seg.segname.c_str(), remap[seg.segnum]);
+		seg.segnum = remap[seg.segnum];
+		for (auto &r : seg.intersegs) r.segment = remap[r.segment];
+	}
 
-void finish(void) {
+	for (auto &v : symbol_values) {
+		if (v.defined && !v.absolute && v.segment < remap.size()) v.segment = remap[v.segment];
+	}
+	for (auto &u : map_units) {
+		if (u.segment < remap.size()) u.segment = remap[u.segment];
+	}
+
+	if (verbose) {
+		std::vector<unsigned> w(weight.size());
+		for (unsigned i = 1; i < weight.size(); ++i) w[remap[i]] = weight[i];
+		weight = std::move(w);
+		fprintf(out_fp, "SUPER encodable intersegs: %u -> %u\n", before, encodable());
+	}
+}
+
+void link_context::finish(void) {
+
+	if (stream) {
+		finish_stream();
+		return;
+	}
 
 	resolve();
+	if (layout) suggest_layout();
+	if (renumber) renumber_segments();
 
 	std::string path = save_file;
 
-	if (path.empty()) path = "omf.out";
+	if (path.empty()) path = full_path("omf.out");
+	map_segments(path);
 
-	if (verbose) printf("Saving %s\n", path.c_str());
+	if (verbose) fprintf(out_fp, "Saving %s\n", path.c_str());
 	try {
 		if (lkv == 0)
-			save_bin(path, segments.back());
+			write_bin(path);
 		else
-			save_omf(path, segments, compress, express, ver);
+			write_omf(path);
+	} catch (std::exception &ex) {
+		throw std::runtime_error(path + ": " + ex.what());
+	}
+
+	check_exd();
+
+	segments.clear();
+	release_arena();
+}
+
+/*
+ * --stream phase 2.  add_unit() only read the labels and sizes, so every
+ * symbol already has its final segment and offset.  Each segment is now
+ * read, resolved, written and freed in turn - only one segment's data and
+ * relocations are in memory at a time.
+ */
+void link_context::finish_stream(void) {
+
+	std::string path = save_file;
+	if (path.empty()) path = full_path("omf.out");
+
+	/* headers only - the data is read below.  copies, so off the arena */
+	std::vector<omf::segment> headers(segments.begin(), segments.end());
+	segments.clear();
+	release_arena();
+
+	if (verbose) fprintf(out_fp, "Saving %s\n", path.c_str());
+	outputs.push_back(path);
+	forget_file(path);
+
+	stream_data = true;
+	try {
+		omf::writer w(path, headers, compress, express, ver);
+
+		size_t next = 0;
+		for (unsigned ix = 0; ix < headers.size(); ++ix) {
+
+			segments.emplace_back(arena.allocator<uint8_t>());
+			segments.back() = headers[ix];
+			relocations.emplace_back();
+
+			for (; next < stream_units.size() && stream_units[next].segment == ix; ++next) {
+				const auto &u = stream_units[next];
+				auto &data = segments.back().data;
+				if (data.size() != u.begin)
+					throw std::runtime_error(u.file + " changed during the link");
+				if (!u.import) {
+					add_unit(u.file);
+					continue;
+				}
+				std::error_code ec;
+				auto mf = open_input(u.file, ec);
+				if (ec) throw std::runtime_error("Unable to open " + u.file + ": " + ec.message());
+				if (mf->size() != u.size)
+					throw std::runtime_error(u.file + " changed during the link");
+				data.insert(data.end(), mf->data(), mf->data() + mf->size());
+			}
+
+			resolve();
+			w.write_segment(segments.back());
+
+			segments.clear();
+			release_arena();
+		}
+		w.close();
 
 		set_file_type(path, ftype, atype);
+		type_cache->update(path, ftype, atype);
 	} catch (std::exception &ex) {
-		errx(EX_OSERR, "%s: %s", path.c_str(), ex.what());
+		/* don't leave a partial file */
+		unlink(path.c_str());
+		stream_data = false;
+		throw std::runtime_error(path + ": " + ex.what());
 	}
+	stream_data = false;
 
+	segments = std::move(headers);
+	map_segments(path);
 	check_exd();
 
 	segments.clear();
-	relocations.clear();
+	stream_units.clear();
+	stream_size = 0;
+}
+
+/* drop everything allocated from the arena, then the arena itself */
+void link_context::release_arena(void) {
+	{
+		decltype(relocations) tmp(relocations.get_allocator());
+		relocations.swap(tmp);
+	}
+	open_files.clear();
+	arena.release();
 }
 
 namespace {
 
-	void push(std::vector<uint8_t> &v, omf::opcode x) {
+	void push(arena_vector<uint8_t> &v, omf::opcode x) {
 		v.push_back(static_cast<uint8_t>(x));
 	}
 
-	void push(std::vector<uint8_t> &v, uint8_t x) {
+	void push(arena_vector<uint8_t> &v, uint8_t x) {
 		v.push_back(x);
 	}
 
-	void push(std::vector<uint8_t> &v, uint16_t x) {
+	void push(arena_vector<uint8_t> &v, uint16_t x) {
 		v.push_back(x & 0xff);
 		x >>= 8;
 		v.push_back(x & 0xff);
 	}
 
-	void push(std::vector<uint8_t> &v, uint32_t x) {
+	void push(arena_vector<uint8_t> &v, uint32_t x) {
 		v.push_back(x & 0xff);
 		x >>= 8;
 		v.push_back(x & 0xff);
@@ -837,21 +2124,15 @@ namespace {
 		v.push_back(x & 0xff);
 	}
 
-	void push(std::vector<uint8_t> &v, const std::string &s) {
+	void push(arena_vector<uint8_t> &v, std::string_view s) {
 		uint8_t count = std::min((int)s.size(), 255);
 		push(v, count);
 		v.insert(v.end(), s.begin(), s.begin() + count);
 	}
 
-	void push(std::vector<uint8_t> &v, const std::string &s, size_t count) {
-		std::string tmp(s, 0, count);
-		tmp.resize(count, ' ');
-		v.insert(v.end(), tmp.begin(), tmp.end());
-	}
-
 }
 
-static void add_expr(std::vector<uint8_t> &buffer, const omf::reloc &r, int ix) {
+void link_context::add_expr(arena_vector<uint8_t> &buffer, const omf::reloc &r, int ix) {
 
 	push(buffer, omf::opcode::EXPR);
 	push(buffer, static_cast<uint8_t>(r.size));
@@ -882,24 +2163,26 @@ static void add_expr(std::vector<uint8_t> &buffer, const omf::reloc &r, int ix)
 
 }
 
-/* REL to OMF object file */
+/* REL to OMF object records, in place.  returns the segment length. */
 /* relocations and labels need to be placed inline */
-void finish3(void) {
+uint32_t link_context::build_object(void) {
 
 	resolve(true); /* allow unresolved references */
 
-	std::vector< std::pair<uint32_t, std::string> > globals;
+	/* symbol names are stable, so no copies */
+	arena_vector< std::pair<uint32_t, std::string_view> > globals(arena.allocator<std::pair<uint32_t, std::string_view>>());
 
 	auto &seg = segments.back();
 	auto &unresolved = relocations.back();
 	auto &resolved = seg.relocs;
 	auto &data = seg.data;
 
-	std::vector<uint8_t> buffer;
+	arena_vector<uint8_t> buffer(arena.allocator<uint8_t>());
 	/* 1. generate GEQU for all global equates */
 	for (const auto &sym : symbol_table) {
-		if (sym.defined) {
-			if (sym.absolute) {
+		const auto &v = symbol_values[sym.id];
+		if (v.defined) {
+			if (v.absolute) {
 
 				push(buffer, omf::opcode::GEQU);
 				push(buffer, sym.name);
@@ -909,9 +2192,12 @@ void finish3(void) {
 					push(buffer, static_cast<uint16_t>(0x00)); /* length attr */
 				}
 				push(buffer, static_cast<uint8_t>('G')); /* type attr */
-				push(buffer, static_cast<uint32_t>(sym.value));
+				push(buffer, static_cast<uint8_t>(0x00)); /* public */
+				push(buffer, static_cast<uint8_t>(0x81)); /* abs */
+				push(buffer, static_cast<uint32_t>(v.value));
+				push(buffer, static_cast<uint8_t>(0x00)); /* end of expr */
 			} else {
-				globals.emplace_back(sym.value, sym.name);
+				globals.emplace_back(v.value, sym.name);
 			}
 		}
 	}
@@ -923,7 +2209,8 @@ void finish3(void) {
 	auto iter2 = unresolved.begin();
 	auto iter3 = resolved.begin();
 
-	std::vector<unsigned> breaks;
+	arena_vector<unsigned> breaks(arena.allocator<unsigned>());
+	breaks.reserve(globals.size() + resolved.size() + unresolved.size());
 	for (const auto &x : globals) {
 		breaks.push_back(x.first);
 	}
@@ -1014,56 +2301,258 @@ void finish3(void) {
 	if (iter3 != resolved.end())
 		throw std::runtime_error("relocation offset error");
 
+	return pc;
+}
+
+/* REL to OMF object file */
+void link_context::finish3(void) {
+
 	void save_object(const std::string &path, omf::segment &s, uint32_t length, unsigned version);
 
+	uint32_t pc = build_object();
+	auto &seg = segments.back();
 
 	std::string path = save_file;
-	if (path.empty()) path = "omf.out";
-	if (verbose) printf("Saving %s\n", path.c_str());
+	if (path.empty()) path = full_path("omf.out");
+	map_segments(path);
+	outputs.push_back(path);
+	if (verbose) fprintf(out_fp, "Saving %s\n", path.c_str());
+	forget_file(path);
 
 	try {
 		save_object(path, seg, pc, ver);
 		set_file_type(path, 0xb1, 0x0000);
+		type_cache->update(path, 0xb1, 0x0000);
 	} catch (std::exception &ex) {
-		errx(EX_OSERR, "%s: %s", path.c_str(), ex.what());
+		throw std::runtime_error(path + ": " + ex.what());
 	}
 
 	print_symbols();
 	segments.clear();
-	relocations.clear();
+	release_arena();
+}
+
+/*
+ * OMF library ($B2).  The first segment is the LIBDICT, 3 LCONST records:
+ * file names, symbol entries (name offset, file number, private, segment offset),
+ * and symbol names.  Only the dictionary and the segments actually needed are read.
+ */
+void link_context::process_library(const std::string &path, const uint8_t *data, size_t size) {
+
+	omf::segment_view sv;
+	if (!omf::read_segment(data, size, sv) || (sv.kind & 0x1f) != 0x08)
+		throw std::runtime_error(path + ": Missing LIBDICT segment");
+
+	byte_view lconst[3];
+	{
+		omf::record_reader rr(sv);
+		omf::record r;
+		unsigned i = 0;
+		while (rr.next(r)) {
+			if (r.opcode != omf::LCONST || i == 3) throw std::runtime_error(path + ": Invalid LIBDICT segment");
+			const uint8_t *cp = r.data + 1;
+			uint32_t n = rr.number(cp);
+			lconst[i++] = byte_view(cp, n);
+		}
+		if (i != 3) throw std::runtime_error(path + ": Invalid LIBDICT segment");
+	}
+
+	const byte_view &entries = lconst[1];
+	const byte_view &names = lconst[2];
+
+	/*
+	 * symbol -> segment offset.  private entries are skipped - they're only
+	 * visible inside their own segment, so they can't satisfy an external.
+	 */
+	std::unordered_map<std::string_view, uint32_t> dict;
+	for (size_t i = 0; i + 12 <= entries.size(); i += 12) {
+		const uint8_t *cp = entries.data() + i;
+		uint32_t name = cp[0] | (cp[1] << 8) | (cp[2] << 16) | (cp[3] << 24);
+		bool priv = cp[6] | cp[7];
+		uint32_t disp = cp[8] | (cp[9] << 8) | (cp[10] << 16) | (cp[11] << 24);
+
+		if (name >= names.size() || name + 1 + names[name] > names.size() || disp >= size)
+			throw std::runtime_error(path + ": Invalid LIBDICT entry");
+
+		if (priv) continue;
+		std::string_view key((const char *)names.data() + name + 1, names[name]);
+		dict[key] = disp;
+	}
+
+	std::unordered_set<uint32_t> loaded;
+	uint32_t total = 0;
+
+	/* segments may add new externals, which are appended and processed. */
+	for (size_t i = 0; i < symbol_table.size(); ++i) {
+
+		const auto &v = symbol_values[i];
+		if (v.absolute || v.defined) continue;
+
+		auto iter = dict.find(symbol_table[i].name);
+		if (iter == dict.end()) continue;
+
+		uint32_t disp = iter->second;
+		if (!loaded.insert(disp).second) continue;
+
+		if (!omf::read_segment(data + disp, size - disp, sv))
+			throw std::runtime_error(path + ": Invalid OMF segment");
+
+		if (verbose) fprintf(out_fp, "Linking %s(%.*s)\n", path.c_str(), (int)sv.segname.size(), sv.segname.data());
+		total += process_object_segment(path, sv);
+	}
+
+	len_var = total;
+	pos_var += total;
 }
 
-void lib(const std::string &path) {
+void link_context::add_library(const std::string &path) {
+
+	/* $B2 library file */
+	{
+		std::error_code ec;
+		uint16_t file_type = 0;
+		uint32_t aux_type = 0;
+		if (type_cache->get(full_path(path), file_type, aux_type, ec) && file_type == 0xb2) {
+			add_unit(path);
+			return;
+		}
+	}
 
 	/* for all unresolved symbols, link path/symbol ( no .L extension) */
 
-	std::string p = path;
+	std::string p = full_path(path);
 	if (!p.empty() && p.back() != '/') p.push_back('/');
 	auto size = p.size();
 
-	/* symbol table might reallocate so can't use for( : ) loop */
 	/* any new dependencies will be appended at the end and processed */
+	/* (so loop by index - a for ( : ) loop stops at the current end) */
 	for (size_t i = 0; i < symbol_table.size(); ++i) {
 
-		auto &e = symbol_table[i];
+		const auto &v = symbol_values[i];
 
-		if (e.absolute || e.defined) continue;
+		if (v.absolute || v.defined) continue;
 
-		p.append(e.name);
+		p.append(symbol_table[i].name);
 
 		/* check the file type... */
 		std::error_code ec;
-		afp::finder_info fi;
+		uint16_t file_type = 0;
+		uint32_t aux_type = 0;
 
-		fi.read(path, ec);
-
-		if (ec || fi.prodos_file_type() != 0xf8) continue;
-		process_unit(p);
+		bool ok = type_cache->get(p, file_type, aux_type, ec);
+		if (ok && file_type == 0xf8) add_unit(p);
 		p.resize(size);
 		// assume e is invalid at this point.
 	}
 }
 
+omf::library_member link_context::object_member(void) {
+
+	omf::library_member m;
+	m.length = build_object();
+
+	for (const auto &sym : symbol_table) {
+		if (symbol_values[sym.id].defined && sym.file != "-D") m.globals.push_back(sym.name);
+	}
+	m.seg = std::move(segments.back());
+	new_segment(true);
+	return m;
+}
+
+
+static std::string make_escape(const std::string &path) {
+	std::string rv;
+	for (char c : path) {
+		if (c == ' ' || c == '#' || c == '\\') rv.push_back('\\');
+		if (c == '$') rv.push_back('$');
+		rv.push_back(c);
+	}
+	return rv;
+}
+
+/* make dependency rule */
+static void write_rule(FILE *fp, const std::vector<std::string> &outputs, std::vector<std::string> inputs) {
+
+	std::sort(inputs.begin(), inputs.end());
+	inputs.erase(std::unique(inputs.begin(), inputs.end()), inputs.end());
+
+	const char *sep = "";
+	for (const auto &s : outputs) {
+		fprintf(fp, "%s%s", sep, make_escape(s).c_str());
+		sep = " ";
+	}
+	fputs(":", fp);
+	for (const auto &s : inputs) {
+		fprintf(fp, " \\\n  %s", make_escape(s).c_str());
+	}
+	fputs("\n", fp);
+}
+
+void make_library(const std::string &path, const std::vector<std::string> &units,
+	const std::function<void(link_context &)> &setup, unsigned jobs, FILE *depfile) {
+
+	std::vector<omf::library_member> members(units.size());
+	std::vector<std::exception_ptr> errors(units.size());
+	std::vector<std::vector<std::string>> inputs(units.size());
+	std::atomic<size_t> next(0);
+
+	/* the units are (usually) in the same directory */
+	auto types = std::make_shared<file_type_cache>();
+
+	/* each unit is converted independently */
+	auto worker = [&]() {
+		for (;;) {
+			size_t i = next++;
+			if (i >= units.size()) return;
+			try {
+				link_context ctx;
+				setup(ctx);
+				ctx.type_cache = types;
+				ctx.add_unit(units[i]);
+				inputs[i] = ctx.input_files();
+				auto &m = members[i] = ctx.object_member();
+				m.file = units[i];
+				if (m.seg.segname.empty()) {
+					auto ix = m.file.find_last_of('/');
+					m.seg.segname = ix == m.file.npos ? m.file : m.file.substr(ix + 1);
+				}
+			} catch (...) {
+				errors[i] = std::current_exception();
+			}
+		}
+	};
+
+	if (!jobs) jobs = std::max(1u, std::thread::hardware_concurrency());
+	jobs = std::min<size_t>(jobs, units.size());
+
+	std::vector<std::thread> threads;
+	for (unsigned i = 1; i < jobs; ++i) threads.emplace_back(worker);
+	worker();
+	for (auto &t : threads) t.join();
+
+	for (size_t i = 0; i < units.size(); ++i) {
+		if (!errors[i]) continue;
+		try {
+			std::rethrow_exception(errors[i]);
+		} catch (std::exception &ex) {
+			throw std::runtime_error(units[i] + ": " + ex.what());
+		}
+	}
+
+	forget_file(path);
+	try {
+		save_library(path, members);
+		set_file_type(path, 0xb2, 0x0000);
+	} catch (std::exception &ex) {
+		throw std::runtime_error(path + ": " + ex.what());
+	}
+	if (depfile) {
+		std::vector<std::string> v;
+		for (const auto &x : inputs) v.insert(v.end(), x.begin(), x.end());
+		write_rule(depfile, { path }, std::move(v));
+	}
+}
+
 static bool op_needs_label(opcode_t op) {
 	switch (op) {
 		case OP_KBD:
@@ -1116,11 +2605,23 @@ static void fix_path(std::string &s) {
 		if (c == ':') c = '/';
 }
 
+/* LNK/LIB/IMP - a bad input isn't a line error, the link can't go on without it */
+template<class F>
+static void load_input(F fn) {
+	try {
+		fn();
+	} catch (input_error &) {
+		throw;
+	} catch (std::exception &ex) {
+		throw input_error(ex.what());
+	}
+}
+
 /*
  SEG name -> undocumented? command to set the OMF segment name (linker 3 only)
 
  */
-void evaluate(label_t label, opcode_t opcode, const char *cursor) {
+void link_context::evaluate(label_t label, opcode_t opcode, const char *cursor) {
 
 	// todo - should move operand parsing to here.
 
@@ -1188,7 +2689,7 @@ void evaluate(label_t label, opcode_t opcode, const char *cursor) {
 			strftime(buffer, sizeof(buffer), "%d-%b-%y  %l:%M:%S %p", tm);
 			for (char &c : buffer) c = std::toupper(c);
 
-			fprintf(stdout, "%s\n", buffer);
+			fprintf(out_fp, "%s\n", buffer);
 			break;
 		}
 
@@ -1196,10 +2697,7 @@ void evaluate(label_t label, opcode_t opcode, const char *cursor) {
 
 			std::string path = path_operand(cursor);
 			fix_path(path);
-
-			int ok = chdir(path.c_str());
-			if (ok < 0)
-				warn("PFX %s", path.c_str());
+			set_prefix(path);
 			break;
 		}
 
@@ -1273,11 +2771,19 @@ void evaluate(label_t label, opcode_t opcode, const char *cursor) {
 			if (end) throw std::runtime_error("link after end");
 
 			std::string path = path_operand(cursor);
-			process_unit(path);
+			load_input([&]{ add_unit(path); });
 			++lnk;
 			break;
 		}
 
+		case OP_LIB: {
+			if (end) throw std::runtime_error("link after end");
+
+			std::string path = path_operand(cursor);
+			load_input([&]{ add_library(path); });
+			break;
+		}
+
 		case OP_IMP: {
 
 			/* qasm addition. import binary file. entry name is filename w/ . converted to _ */
@@ -1286,20 +2792,23 @@ void evaluate(label_t label, opcode_t opcode, const char *cursor) {
 			for (char &c : name) {
 				c = std::isalnum(c) ? std::toupper(c) : '_';
 			}
-			import(path, name);
+			load_input([&]{ add_import(path, name); });
 			++lnk;
 			break;
 		}
 
 		case OP_SAV: {
 			if (end) throw std::runtime_error("save after end");
+			/* binaries and objects are built whole */
+			if (stream && (lkv == 0 || lkv == 3))
+				throw std::runtime_error("LKV " + std::to_string(lkv) + " can't be linked with --stream");
 
 			std::string path = path_operand(cursor);
 			std::string base = basename(path);
 			auto &seg = segments.back();
 
 			/* use 1st SAV as the path */
-			if (save_file.empty()) save_file = path;
+			if (save_file.empty()) save_file = full_path(path);
 			if (loadname.empty()) loadname = base;
 
 			/*
@@ -1324,7 +2833,7 @@ void evaluate(label_t label, opcode_t opcode, const char *cursor) {
 					new_segment(true);
 					break;
 				case 2:
-					if (verbose) printf("Segment %d: %s\n", seg.segnum, base.c_str());
+					if (verbose) fprintf(out_fp, "Segment %d: %s\n", seg.segnum, base.c_str());
 					/* add a new segment */
 					new_segment();
 					break;
@@ -1340,6 +2849,7 @@ void evaluate(label_t label, opcode_t opcode, const char *cursor) {
 
 		case OP_ENT:
 			print_symbols();
+			if (!symbols_file.empty()) save_symbols(symbols_file);
 			break;
 
 		case OP_KBD: {
@@ -1355,6 +2865,9 @@ void evaluate(label_t label, opcode_t opcode, const char *cursor) {
 
 			if (prompt.empty()) prompt = "Give value for " + label;
 			prompt += ": ";
+
+			/* scripts may be running in parallel - one prompt at a time */
+			std::lock_guard<std::mutex> lock(console_mutex);
 			fputs(prompt.c_str(), stdout);
 			fflush(stdout);
 
@@ -1406,8 +2919,8 @@ void evaluate(label_t label, opcode_t opcode, const char *cursor) {
 
 			/* otherwise, it imports an absolute label into the local symbol table */
 			auto e = find_symbol(label, false);
-			if (!e || !e->absolute) throw std::runtime_error("Bad address");
-			define(label, e->value, LBL_EXT);
+			if (!e || !value_of(e).absolute) throw std::runtime_error("Bad address");
+			define(label, value_of(e).value, LBL_EXT);
 
 			break;
 		}
@@ -1446,9 +2959,149 @@ void evaluate(label_t label, opcode_t opcode, const char *cursor) {
 
 }
 
-void process_script(const char *path) {
+/* inputs are recorded relative to the starting directory until there's a PFX */
+void link_context::add_input(const std::string &path) {
+	inputs.push_back(pfx ? absolute_path(path) : path);
+}
+
+/*
+ * PFX - later relative paths are relative to path (which may itself be
+ * relative to the previous PFX).  The directory is opened once and files
+ * are opened relative to it; the process directory is left alone so
+ * other contexts aren't affected.
+ */
+void link_context::set_prefix(const std::string &path) {
+
+	int fd = openat(prefix_fd < 0 ? AT_FDCWD : prefix_fd, path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0) {
+		warning("PFX %s: %s", path.c_str(), strerror(errno));
+		return;
+	}
+	if (prefix_fd >= 0) close(prefix_fd);
+	prefix_fd = fd;
+
+	/* canonical, like getcwd() after a chdir */
+	prefix = absolute_path(full_path(path));
+	if (char *cp = realpath(prefix.c_str(), nullptr)) {
+		prefix = cp;
+		free(cp);
+	}
+	if (prefix.back() != '/') prefix.push_back('/');
+	pfx = true;
+}
+
+void link_context::add_map_unit(const std::string &path, uint32_t begin, uint32_t end) {
+	map_unit u;
+	u.file = path;
+	u.segment = segments.back().segnum;
+	u.begin = begin;
+	u.end = end;
+	map_units.emplace_back(std::move(u));
+}
+
+/* append the units, the symbols they define, and unresolved symbols to the map */
+void link_context::map_segments(const std::string &output) {
+
+	if (!map) {
+		map_units.clear();
+		return;
+	}
+
+	std::unordered_map<std::string, std::vector<const symbol *>> defines;
+	std::vector<const symbol *> unresolved;
+	for (const auto &e : symbol_table) {
+		if (symbol_values[e.id].defined) defines[e.file].push_back(&e);
+		else if (e.count) unresolved.push_back(&e);
+	}
+
+	char buffer[64];
+	map_text += output;
+	map_text += ":\n";
+	for (const auto &seg : segments) {
+		snprintf(buffer, sizeof(buffer), "  Segment %u: ", seg.segnum);
+		map_text += buffer;
+		map_text += seg.segname;
+		map_text += '\n';
+
+		for (const auto &u : map_units) {
+			if (u.segment != seg.segnum) continue;
+			snprintf(buffer, sizeof(buffer), "    $%06x-$%06x ", u.begin, u.end);
+			map_text += buffer;
+			map_text += u.file;
+			map_text += '\n';
+
+			/* once per file - library segments share the file */
+			auto iter = defines.find(u.file);
+			if (iter == defines.end()) continue;
+			for (const symbol *e : iter->second) {
+				const auto &v = symbol_values[e->id];
+				snprintf(buffer, sizeof(buffer), "      %c =$%06x ", v.absolute ? 'A' : 'R', v.value);
+				map_text += buffer;
+				map_text += e->name;
+				map_text += '\n';
+			}
+			defines.erase(iter);
+		}
+	}
+	for (const symbol *e : unresolved) {
+		map_text += "  Unresolved: ";
+		map_text += e->name;
+		map_text += '\n';
+	}
+	map_units.clear();
+}
+
+void link_context::write_map(FILE *fp) {
+	fputs(map_text.c_str(), fp);
+	map_text.clear();
+}
+
+void link_context::write_depfile(FILE *fp) {
+	if (outputs.empty()) return;
+	write_rule(fp, outputs, inputs);
+}
+
+/* parse every line of a script, ahead of time.  errors are reported when it's evaluated */
+template<class F>
+static bool scan_script(const char *path, F fn) {
+
+	FILE *fp = fopen(path, "r");
+	if (!fp) return false;
+
+	char *line = NULL;
+	size_t cap = 0;
+	for (int no = 1; ; ++no) {
+		ssize_t len = getline(&line, &cap, fp);
+		if (len <= 0) break;
+
+		while (len && isspace(line[len-1])) --len;
+		line[len] = 0;
+		if (len == 0) continue;
+
+		try {
+			label_t label;
+			const char *cursor = nullptr;
+			opcode_t opcode = parse_line(line, label, cursor);
+			if (opcode != OP_NONE) fn(no, opcode, cursor);
+		} catch (std::exception &) {
+		}
+	}
+	fclose(fp);
+	free(line);
+	return true;
+}
+
+void script_files(const char *path, std::vector<std::string> &inputs, std::vector<std::string> &outputs) {
+
+	scan_script(path, [&](int, opcode_t opcode, const char *cursor) {
+		if (opcode == OP_LNK || opcode == OP_IMP || opcode == OP_LIB)
+			inputs.emplace_back(path_operand(cursor));
+		if (opcode == OP_SAV)
+			outputs.emplace_back(path_operand(cursor));
+	});
+}
 
-	extern void parse_line(const char *);
+int link_context::add_script(const char *path) {
 
 	FILE *fp = nullptr;
 
@@ -1456,13 +3109,11 @@ void process_script(const char *path) {
 	else {
 		fp = fopen(path, "r");
 		if (!fp) {
-			err(1, "Unable to open %s", path);
+			throw std::system_error(errno, std::generic_category(), std::string("Unable to open ") + path);
 		}
+		add_input(path);
 	}
 
-
-	new_segment();
-
 	int no = 1;
 	int errors = 0;
 	char *line = NULL;
@@ -1479,14 +3130,22 @@ void process_script(const char *path) {
 		if (len == 0) continue; 
 
 		try {
-			parse_line(line);
+			label_t label;
+			const char *cursor = nullptr;
+			opcode_t opcode = parse_line(line, label, cursor);
+			if (opcode != OP_NONE) evaluate(label, opcode, cursor);
+		} catch (input_error &) {
+			/* fatal - no output from a partial link */
+			if (fp != stdin) fclose(fp);
+			free(line);
+			throw;
 		} catch (std::exception &ex) {
 			if (!active) continue;
 
-			fprintf(stderr, "%s in line: %d\n", ex.what(), no);
-			fprintf(stderr, "%s\n", line);
+			fprintf(err_fp, "%s in line: %d\n", ex.what(), no);
+			fprintf(err_fp, "%s\n", line);
 			if (++errors >= 10) {
-				fputs("Too many errors, aborting\n", stderr);
+				fputs("Too many errors, aborting\n", err_fp);
 				break;
 			}
 		}
@@ -1494,26 +3153,6 @@ void process_script(const char *path) {
 	if (fp != stdin)
 		fclose(fp);
 	free(line);
-	exit(errors ? EX_DATAERR : 0);
-}
-
-
-
-
-void process_files(int argc, char **argv) {
-
-	new_segment();
-
-	for (int i = 0; i < argc; ++i) {
-		char *path = argv[i];
-		try {
-			process_unit(path);
-		} catch (std::exception &ex) {
-			errx(EX_DATAERR, "%s: %s", path, ex.what());
-		}
-	}
-	finish();
-	if (verbose) print_symbols();
-	exit(0);
+	return errors;
 }
 
@@ -1,26 +1,45 @@
 #ifndef link_h
 #define link_h
 
+#include <cstdio>
+#include <functional>
+#include <memory>
+#include <stdexcept>
 #include <string>
+#include <string_view>
+#include <system_error>
+#include <unordered_map>
+#include <vector>
 #include <cstdint>
 
-extern bool verbose;
-extern bool compress;
-extern bool express;
-extern std::string save_file;
+#include "arena.h"
+#include "chunked_vector.h"
+#include "omf.h"
+#include "script.h"
+#include "symbol_index.h"
 
+class mapped_file;
+class file_type_cache;
 
+
+/* cold - names and bookkeeping */
 struct symbol {
 	std::string name;
 	std::string file;
-	uint32_t value = 0;
 	unsigned id = 0;
-	unsigned segment = 0;
 	unsigned count = 0;
+};
 
-	bool absolute = false;
-	bool defined = false;
-	bool exd = false;
+/* hot - everything resolve() needs, in 8 bytes. indexed by symbol id */
+struct symbol_value {
+	uint32_t value = 0;
+	uint16_t segment = 0;
+
+	bool absolute : 1;
+	bool defined : 1;
+	bool exd : 1;
+
+	symbol_value() : absolute(false), defined(false), exd(false) {}
 };
 
 /*
@@ -52,13 +71,237 @@ enum {
 	LBL_EXT = (1 << 2)
 };
 
-void process_script(const char *argv);
-void process_files(int argc, char **argv);
 
+/* since span isn't standard yet */
+typedef std::basic_string_view<uint8_t> byte_view;
+
+struct pending_reloc : public omf::reloc {
+	unsigned id = 0;
+	bool relative = false; /* OMF RELEXPR */
+};
+
+struct cookie {
+	explicit cookie(const arena_allocator<unsigned> &a) : remap(a) {}
+
+	std::string file;
+	arena_vector<unsigned> remap;
+
+	uint32_t begin = 0;
+	uint32_t end = 0;
+};
+
+/* --stream: a REL unit (or IMP file) placed by phase 1 */
+struct stream_unit {
+	std::string file;
+	unsigned segment = 0; /* index */
+	uint32_t begin = 0;
+	uint32_t size = 0; /* IMP only */
+	bool import = false;
+};
+
+/* link map entry - where a unit ended up */
+struct map_unit {
+	std::string file;
+	unsigned segment = 0;
+	uint32_t begin = 0;
+	uint32_t end = 0;
+};
+
+/* an input (LNK, LIB, IMP) couldn't be read or decoded.  ends a script. */
+class input_error : public std::runtime_error {
+public:
+	using std::runtime_error::runtime_error;
+};
+
+
+/*
+ * All the state for one link.  Independent contexts may be used
+ * concurrently.  PFX is per context - relative paths are resolved against
+ * its directory, the process directory never changes.
+ *
+ * Errors are thrown as std::exception.
+ */
+class link_context {
+public:
+
+	link_context();
+	~link_context();
+
+	link_context(const link_context &) = delete;
+	link_context &operator=(const link_context &) = delete;
+
+	/* options */
+	bool verbose = false;
+	bool compress = true;
+	bool express = true;
+	bool map = false; /* collect link map text */
+	bool layout = false; /* report LKV 2 segment layout suggestions */
+	bool renumber = false; /* order LKV 2 segments by interseg references */
+	bool split = false; /* split code segments over 64K at unit boundaries */
+	bool stream = false; /* two phase link (REL and IMP inputs only) - see finish_stream() */
+	size_t read_threshold = 0; /* inputs up to this size are read, not mapped (0 = always map) */
+	FILE *out_fp = stdout; /* -v, ENT and report output */
+	FILE *err_fp = stderr; /* warnings and script line errors */
+	std::string symbols_file; /* binary symbol table, written on ENT */
+	std::string save_file;
+
+	/*
+	 * file type lookups, cached for the life of the context so files created
+	 * between links are seen.  contexts linking at the same time may share one.
+	 */
+	std::shared_ptr<file_type_cache> type_cache;
+
+	/* library api */
+	void add_unit(const std::string &path);
+	void add_import(const std::string &path, const std::string &name);
+	void add_library(const std::string &path);
+	int add_script(const char *path);
+
+	/*
+	 * dead code stripping - drop the REL units that aren't reachable from the first unit
+	 * (or a keep unit/symbol) by EXT -> ENT references.  returns the bytes removed.
+	 */
+	size_t gc_units(std::vector<std::string> &units, const std::vector<std::string> &keep);
+
+	void resolve(bool allow_unresolved = false);
+	void write_omf(const std::string &path);
+	void write_bin(const std::string &path);
+
+	/* resolve and save to save_file (default omf.out) */
+	void finish(void);
+	void finish3(void);
+
+	/* convert the current segment to an OMF object segment and start over */
+	omf::library_member object_member(void);
 
-symbol *find_symbol(const std::string &name, bool insert = true);
+	void print_symbols(void);
+	void save_symbols(const std::string &path);
 
-void define(std::string name, uint32_t value, int type);
+	/* per-link allocations, for --stats */
+	const arena_stats &stats(void) const { return arena.stats(); }
+
+	/* make dependencies (every output: every input read) and the link map */
+	void write_depfile(FILE *fp);
+	void write_map(FILE *fp);
+
+	/* an input read outside the context (eg, a -D @file symbol file) */
+	void add_input(const std::string &path);
+	const std::vector<std::string> &input_files(void) const { return inputs; }
+
+	/* the symbol id (and pointer) is stable until the symbol table is reset. */
+	symbol *find_symbol(const std::string &name, bool insert = true);
+
+	symbol_value &value_of(const symbol *e) { return symbol_values[e->id]; }
+
+	void define(std::string name, uint32_t value, int type);
+
+	void evaluate(label_t label, opcode_t opcode, const char *cursor);
+
+private:
+
+	void new_segment(bool reset = false);
+	void reset_symbols(void);
+	void release_arena(void);
+
+	void warning(const char *fmt, ...) const __attribute__((format(printf, 2, 3)));
+
+	void process_labels(byte_view &data, cookie &cookie, bool define = true);
+	void process_reloc(byte_view &data, cookie &cookie);
+	void process_ds_err(byte_view &data);
+
+	void process_object(const std::string &path, const uint8_t *data, size_t size);
+	uint32_t process_object_segment(const std::string &path, const omf::segment_view &sv);
+	void process_library(const std::string &path, const uint8_t *data, size_t size);
+
+	uint32_t build_object(void);
+
+	void finish_stream(void);
+
+	void set_prefix(const std::string &path);
+	std::string full_path(const std::string &path) const;
+	std::shared_ptr<const mapped_file> open_input(const std::string &path, std::error_code &ec);
+	std::shared_ptr<const mapped_file> open_unit(const std::string &path, uint16_t &file_type, uint32_t &aux_type,
+		bool need_type = true, std::string *opened = nullptr);
+	void add_map_unit(const std::string &path, uint32_t begin, uint32_t end);
+	void map_segments(const std::string &output);
+
+	void canonicalize_relocs(omf::segment &seg);
+	void suggest_layout(void);
+	void renumber_segments(void);
+	void split_segment(unsigned ix);
+
+	void print_symbols2(const std::vector<size_t> &ix);
+	void check_exd(void);
+	void add_expr(arena_vector<uint8_t> &buffer, const omf::reloc &r, int ix);
+
+
+	/* must outlive everything allocated from it */
+	link_arena arena;
+
+	symbol_index symbol_map;
+	chunked_vector<symbol> symbol_table;
+	chunked_vector<symbol_value> symbol_values;
+
+	std::vector<omf::segment> segments;
+	arena_vector<arena_vector<pending_reloc>> relocations;
+
+	/* script related */
+	unsigned lkv = 1;
+	unsigned ver = 2;
+	unsigned ftype = 0xb3;
+	unsigned atype = 0x0000;
+	unsigned org = 0x0000;
+
+	unsigned sav = 0;
+	unsigned lnk = 0;
+	bool end = false;
+	bool fas = false;
+	int ovr = OVR_OFF;
+
+	size_t pos_var = 0;
+	size_t len_var = 0;
+
+	/* do/els/fin stuff.  32 do levels supported. */
+	uint32_t active_bits = 1;
+	bool active = true;
+
+	std::unordered_map<std::string, uint32_t> local_symbol_table;
+
+	std::string loadname;
+
+	/* --stream */
+	bool stream_data = false; /* phase 2 */
+	uint32_t stream_size = 0;
+	std::vector<stream_unit> stream_units;
+
+	/* PFX directory (absolute, with a trailing /) and an fd for openat */
+	std::string prefix;
+	int prefix_fd = -1;
+
+	/* inputs this link has open.  dropped by release_arena(), with the rest of the link */
+	std::vector<std::shared_ptr<const mapped_file>> open_files;
+
+	/* dependency / map tracking */
+	bool pfx = false;
+	std::vector<std::string> inputs;
+	std::vector<std::string> outputs;
+	std::vector<map_unit> map_units;
+	std::string map_text;
+};
+
+/*
+ * Convert REL units to object segments (jobs at a time, 0 = one per cpu)
+ * and save them as an OMF library.  setup configures each unit's context.
+ * The make dependency rule is written to depfile, if any.
+ */
+void make_library(const std::string &path, const std::vector<std::string> &units,
+	const std::function<void(link_context &)> &setup, unsigned jobs = 0, FILE *depfile = nullptr);
+
+/*
+ * The files a script reads (LNK, LIB, IMP) and saves (SAV), as written -
+ * relative to whatever PFX is in effect at the time.
+ */
+void script_files(const char *path, std::vector<std::string> &inputs, std::vector<std::string> &outputs);
 
 
-#endif
\ No newline at end of file
+#endif
@@ -1,12 +1,21 @@
 
+#include <algorithm>
+#include <condition_variable>
+#include <exception>
+#include <memory>
+#include <mutex>
 #include <string_view>
 #include <string>
+#include <thread>
+#include <unordered_map>
 #include <utility>
+#include <vector>
 
 #include <cerrno>
 #include <cstdint>
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
 #include <cctype>
 
 /* old version of stdlib have this stuff in utility */
@@ -16,21 +25,40 @@
 #endif
 
 #include <err.h>
+#include <getopt.h>
 #include <sysexits.h>
 #include <unistd.h>
 
 #include "link.h"
+#include "mapped_file.h"
+#include "symbol_file.h"
 
 static void usage(int ex) {
 
 	fputs(
 		"merlin-link [options] infile...\n"
+		"merlin-link [options] -S script...\n"
+		"merlin-link [options] --make-lib outfile infile...\n"
 		"\noptions:\n"
 		"-C              inhibit SUPER compression\n"
 		"-D symbol=value define symbol\n"
+		"-D @file        define symbols from a symbol file\n"
 		"-X              inhibit expressload segment\n"
 		"-o outfile      specify output file (default gs.out)\n"
 		"-v              be verbose\n"
+		"-M depfile      write make dependencies\n"
+		"--map file      write a link map\n"
+		"--layout        suggest LKV 2 unit placement\n"
+		"--renumber      order LKV 2 segments by interseg references\n"
+		"--split         split code segments larger than a bank\n"
+		"--stream        two pass link, one segment in memory at a time\n"
+		"--sym file      save a binary symbol file (with -v or ENT)\n"
+		"--make-lib file convert REL files to an OMF library\n"
+		"--gc            only link units reachable from the first one\n"
+		"--keep name     retain the unit or symbol with --gc\n"
+		"--stats         report per-link allocations\n"
+		"--read-threshold bytes\n"
+		"                read (don't map) input files up to this size\n"
 		"\n",
 		stderr);
 
@@ -57,12 +85,31 @@ static bool parse_number(const char *begin, const char *end, uint32_t &value, in
 	return true;
 }
 
+static std::vector<std::pair<std::string, uint32_t>> defines;
+static std::vector<std::string> symbol_files; /* -D @file, for -M */
+
 static void add_define(std::string str) {
 	/* -D key[=value]
  		value = 0x, $, % or base 10 */
 
 	uint32_t value = 0;
 
+	/* -D @file - binary symbol file. relocatable values are segment << 16 | offset */
+	if (!str.empty() && str[0] == '@') {
+		try {
+			symbol_file sf(str.substr(1));
+			symbol_files.push_back(str.substr(1));
+			for (size_t i = 0; i < sf.size(); ++i) {
+				auto e = sf[i];
+				value = e.absolute ? e.value : (e.segment << 16) | e.value;
+				defines.emplace_back(std::string(e.name), value);
+			}
+		} catch (std::exception &ex) {
+			errx(EX_DATAERR, "%s", ex.what());
+		}
+		return;
+	}
+
 	auto ix = str.find('=');
 	if (ix == 0) usage(EX_USAGE);
 	if (ix == str.npos) {
@@ -93,7 +140,7 @@ static void add_define(std::string str) {
 	}
 
 
-	define(str, value, LBL_D);
+	defines.emplace_back(str, value);
 }
 
 /* .ends_with() is c++20 */
@@ -104,18 +151,249 @@ static bool is_S(std::string_view sv) {
 }
 
 
-bool verbose = false;
-std::string save_file;
-bool express = true;
-bool compress = true;
+static bool verbose = false;
+static std::string save_file;
+static bool express = true;
+static bool compress = true;
+static bool layout = false;
+static bool renumber = false;
+static bool split = false;
+static bool stream = false;
+static std::string symbols_file;
+static bool stats = false;
+static size_t read_threshold = mapped_file::read_threshold();
+
+static std::string dep_file;
+static std::string map_file;
+static FILE *dep_fp = nullptr;
+static FILE *map_fp = nullptr;
+
+static FILE *open_output(const std::string &path) {
+	if (path.empty()) return nullptr;
+	FILE *fp = fopen(path.c_str(), "w");
+	if (!fp) err(EX_CANTCREAT, "%s", path.c_str());
+	return fp;
+}
+
+/* after each link */
+static void write_extras(link_context &ctx, FILE *dep, FILE *map) {
+	if (dep) ctx.write_depfile(dep);
+	if (map) ctx.write_map(map);
+	if (stats) {
+		const auto &st = ctx.stats();
+		fprintf(ctx.out_fp, "Allocations: %zu (%zu bytes), peak %zu bytes in use, %zu bytes held, %zu releases\n",
+			st.allocations, st.bytes, st.peak, st.held, st.releases);
+	}
+}
+
+static void write_extras(link_context &ctx) {
+	write_extras(ctx, dep_fp, map_fp);
+}
+
+static void close_extras(void) {
+	if (dep_fp) fclose(dep_fp);
+	if (map_fp) fclose(map_fp);
+	dep_fp = map_fp = nullptr;
+}
+
+static void setup(link_context &ctx) {
+	ctx.verbose = verbose;
+	ctx.map = !map_file.empty();
+	ctx.layout = layout;
+	ctx.renumber = renumber;
+	ctx.split = split;
+	ctx.stream = stream;
+	ctx.read_threshold = read_threshold;
+	ctx.symbols_file = symbols_file;
+	ctx.express = express;
+	ctx.compress = compress;
+	ctx.save_file = save_file;
+	for (const auto &d : defines) ctx.define(d.first, d.second, LBL_D);
+	for (const auto &s : symbol_files) ctx.add_input(s);
+}
+
+/* open_memstream() output, written out later */
+struct held_output {
+	FILE *fp = nullptr;
+	char *data = nullptr;
+	size_t size = 0;
+
+	held_output() {
+		fp = open_memstream(&data, &size);
+		if (!fp) err(EX_OSERR, "open_memstream");
+	}
+	~held_output() {
+		if (fp) fclose(fp);
+		free(data);
+	}
+	held_output(const held_output &) = delete;
+	held_output &operator=(const held_output &) = delete;
+
+	void write(FILE *to) {
+		fclose(fp);
+		fp = nullptr;
+		if (to) fwrite(data, 1, size, to);
+	}
+};
+
+/* one script, linked on a worker thread */
+struct script_job {
+	const char *path = nullptr;
+	int after = -1; /* reads something this earlier script saves */
+	held_output out, err, dep, map;
+	int errors = 0;
+	std::exception_ptr error;
+	bool done = false;
+};
+
+/* file name, without the directory (PFX isn't known ahead of time) */
+static std::string file_key(const std::string &path) {
+	auto ix = path.find_last_of("/:");
+	std::string rv = ix == path.npos ? path : path.substr(ix + 1);
+	for (char &c : rv) c = std::toupper(c);
+	return rv;
+}
+
+/*
+ * Scripts are independent links, so they run in parallel (each with its
+ * own context; inputs open in more than one are shared) - except a script
+ * that reads a file an earlier one saves waits for it.  Output is held and
+ * printed in script order.  An input error ends the batch there (scripts
+ * already running still finish).  Returns the line error count.
+ */
+static int run_scripts(int argc, char **argv) {
+
+	std::unique_ptr<script_job[]> jobs(new script_job[argc]);
+	std::unordered_map<std::string, int> saved_by;
+	for (int i = 0; i < argc; ++i) {
+		auto &job = jobs[i];
+		job.path = argv[i];
+
+		std::vector<std::string> inputs, outputs;
+		script_files(job.path, inputs, outputs);
+		for (const auto &p : inputs) {
+			auto iter = saved_by.find(file_key(p));
+			if (iter != saved_by.end()) job.after = std::max(job.after, iter->second);
+		}
+		for (const auto &p : outputs) saved_by[file_key(p)] = i;
+	}
+
+	std::mutex mutex;
+	std::condition_variable cv;
+	int next = 0;
+	bool stop = false;
+
+	auto worker = [&]() {
+		for (;;) {
+			script_job *job;
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				if (stop || next >= argc) return;
+				job = &jobs[next++];
+
+				/* (taken in order, so whoever has it will finish it) */
+				if (job->after >= 0) {
+					auto &prev = jobs[job->after];
+					cv.wait(lock, [&]{ return prev.done; });
+					/* its error ends the batch before this one is printed */
+					job->error = prev.error;
+				}
+			}
+			if (!job->error) {
+				try {
+					link_context ctx;
+					setup(ctx);
+					ctx.out_fp = job->out.fp;
+					ctx.err_fp = job->err.fp;
+					job->errors = ctx.add_script(job->path);
+					write_extras(ctx, dep_fp ? job->dep.fp : nullptr, map_fp ? job->map.fp : nullptr);
+				} catch (...) {
+					job->error = std::current_exception();
+				}
+			}
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				job->done = true;
+			}
+			cv.notify_all();
+		}
+	};
+
+	unsigned n = std::min<unsigned>(std::max(1u, std::thread::hardware_concurrency()), argc);
+	std::vector<std::thread> threads;
+	for (unsigned i = 0; i < n; ++i) threads.emplace_back(worker);
+
+	int errors = 0;
+	std::exception_ptr error;
+	for (int i = 0; i < argc && !error; ++i) {
+		auto &job = jobs[i];
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			cv.wait(lock, [&]{ return job.done; });
+		}
+		job.out.write(stdout);
+		fflush(stdout);
+		job.err.write(stderr);
+		job.dep.write(dep_fp);
+		job.map.write(map_fp);
+		errors += job.errors;
+		error = job.error;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stop = true;
+	}
+	for (auto &t : threads) t.join();
+
+	if (error) std::rethrow_exception(error);
+	return errors;
+}
 
 int main(int argc, char **argv) {
 
+	static struct option longopts[] = {
+		{ "make-lib", required_argument, nullptr, 1 },
+		{ "gc", no_argument, nullptr, 2 },
+		{ "keep", required_argument, nullptr, 3 },
+		{ "map", required_argument, nullptr, 4 },
+		{ "layout", no_argument, nullptr, 5 },
+		{ "renumber", no_argument, nullptr, 6 },
+		{ "split", no_argument, nullptr, 7 },
+		{ "sym", required_argument, nullptr, 8 },
+		{ "stats", no_argument, nullptr, 9 },
+		{ "stream", no_argument, nullptr, 10 },
+		{ "read-threshold", required_argument, nullptr, 11 },
+		{ nullptr, 0, nullptr, 0 }
+	};
+
 	int c;
 	bool script = false;
+	std::string lib_file;
+	bool gc = false;
+	std::vector<std::string> keep;
 
-	while ((c = getopt(argc, argv, "o:D:XCSv")) != -1) {
+	while ((c = getopt_long(argc, argv, "o:D:M:XCSv", longopts, nullptr)) != -1) {
 		switch(c) {
+			case 1:
+				lib_file = optarg;
+				break;
+			case 2: gc = true; break;
+			case 3: keep.emplace_back(optarg); break;
+			case 4: map_file = optarg; break;
+			case 5: layout = true; break;
+			case 6: renumber = true; break;
+			case 7: split = true; break;
+			case 8: symbols_file = optarg; break;
+			case 9: stats = true; break;
+			case 10: stream = true; break;
+			case 11: {
+				uint32_t value = 0;
+				if (!parse_number(optarg, optarg + strlen(optarg), value)) usage(EX_USAGE);
+				read_threshold = value;
+				break;
+			}
+			case 'M': dep_file = optarg; break;
 			case 'o':
 				save_file = optarg;
 				break;
@@ -136,11 +414,85 @@ int main(int argc, char **argv) {
 	argc -= optind;
 
 	if (!script && !argc) usage(EX_USAGE);
-	if (script && argc > 1) usage(EX_USAGE);
-	if (argc == 1 && is_S(*argv)) script = true;
+	if (gc && (script || !lib_file.empty())) usage(EX_USAGE);
+	/* these need the whole program in memory */
+	if (stream && (!lib_file.empty() || split || renumber || layout)) usage(EX_USAGE);
+	/* nothing is linked, so there's no map */
+	if (!lib_file.empty() && (script || !map_file.empty())) usage(EX_USAGE);
+
+	dep_fp = open_output(dep_file);
+	map_fp = open_output(map_file);
 
-	if (script) process_script(argc ? *argv : nullptr);
-	else process_files(argc, argv);
+	if (!lib_file.empty()) {
+		try {
+			make_library(lib_file, std::vector<std::string>(argv, argv + argc), setup, 0, dep_fp);
+		} catch (std::exception &ex) {
+			errx(EX_DATAERR, "%s", ex.what());
+		}
+		close_extras();
+		exit(0);
+	}
+	if (argc && std::all_of(argv, argv + argc, is_S)) script = true;
+
+	if (script) {
+		int errors = 0;
+		if (argc > 1) {
+			try {
+				errors = run_scripts(argc, argv);
+			} catch (std::exception &ex) {
+				errx(1, "%s", ex.what());
+			}
+		} else {
+			link_context ctx;
+			setup(ctx);
+			try {
+				errors = ctx.add_script(argc ? argv[0] : nullptr);
+			} catch (std::exception &ex) {
+				errx(1, "%s", ex.what());
+			}
+			write_extras(ctx);
+		}
+		close_extras();
+		exit(errors ? EX_DATAERR : 0);
+	}
+
+	link_context ctx;
+	setup(ctx);
+
+	std::vector<std::string> units(argv, argv + argc);
+	if (gc) {
+		try {
+			ctx.gc_units(units, keep);
+		} catch (std::exception &ex) {
+			errx(EX_DATAERR, "%s", ex.what());
+		}
+	}
+
+	for (const auto &path : units) {
+		try {
+			ctx.add_unit(path);
+		} catch (std::exception &ex) {
+			errx(EX_DATAERR, "%s", ex.what());
+		}
+	}
+
+	try {
+		ctx.finish();
+	} catch (std::exception &ex) {
+		errx(EX_OSERR, "%s", ex.what());
+	}
+	if (verbose) {
+		ctx.print_symbols();
+		if (!symbols_file.empty()) {
+			try {
+				ctx.save_symbols(symbols_file);
+			} catch (std::exception &ex) {
+				errx(EX_CANTCREAT, "%s", ex.what());
+			}
+		}
+	}
 
+	write_extras(ctx);
+	close_extras();
 	exit(0);
 }
\ No newline at end of file
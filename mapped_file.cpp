@@ -1,5 +1,6 @@
 #include "mapped_file.h"
 #include "unique_resource.h"
+#include <atomic>
 #include <memory>
 #include <functional>
 #include <system_error>
@@ -12,6 +13,20 @@ namespace {
 		else throw std::system_error(error, std::system_category(), what);
 	}
 
+	/*
+	 * open + read + close beats open + mmap + munmap by 2-5x up to 128K
+	 * (warm cache), they're even at 256K and mmap wins from 512K.  128K is
+	 * also where malloc starts mapping blocks itself.
+	 */
+	std::atomic<size_t> threshold(128 * 1024);
+}
+
+size_t mapped_file_base::read_threshold() {
+	return threshold.load(std::memory_order_relaxed);
+}
+
+void mapped_file_base::set_read_threshold(size_t size) {
+	threshold.store(size, std::memory_order_relaxed);
 }
 
 #ifdef _WIN32
@@ -222,7 +237,10 @@ void mapped_file_base::create(const std::wstring &p, size_t length, std::error_c
 #include <fcntl.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
+#include <algorithm>
 #include <cerrno>
+#include <cstdlib>
+#include <cstring>
 
 namespace {
 
@@ -240,14 +258,119 @@ namespace {
 
 void mapped_file_base::close() {
 	if (is_open()) {
-		::munmap(_data, _size);
-		::close(_fd);
+		if (_heap) std::free(_data);
+		else ::munmap(_data, _size);
+		if (_fd >= 0) ::close(_fd);
 		reset();
 	}
 }
 
+/* small files - one read into a buffer. */
+void mapped_file_base::open_read(int fd, size_t length, std::error_code *ec) {
+
+	void *data = std::malloc(length);
+	if (!data) return set_or_throw_error(ec, ENOMEM, "malloc");
+
+	size_t size = 0;
+	while (size < length) {
+		ssize_t n = ::pread(fd, (char *)data + size, length - size, size);
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			auto e = errno;
+			std::free(data);
+			return set_or_throw_error(ec, e, "read");
+		}
+		if (n == 0) break;
+		size += n;
+	}
+
+	if (size == 0) {
+		std::free(data);
+		return;
+	}
+
+	_data = data;
+	_size = size;
+	_flags = readonly;
+	_heap = true;
+}
+
+/*
+ * pipes, fifos, and procfs-style files can't be mapped (or report a 0 size),
+ * so read them in large chunks into an anonymous mapping.  close() doesn't
+ * need to know the difference.
+ */
+void mapped_file_base::open_stream(int fd, size_t length, size_t offset, std::error_code *ec) {
+
+	const size_t chunk = 64 * 1024;
+
+	size_t capacity = 0;
+	size_t size = 0;
+	void *data = nullptr;
+
+	auto unmap = [&](){ if (data) ::munmap(data, capacity); };
+
+	// skip over the offset.
+	while (offset) {
+		char buffer[4096];
+		ssize_t n = ::read(fd, buffer, std::min(offset, sizeof(buffer)));
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			return set_or_throw_error(ec, "read");
+		}
+		if (n == 0) return;
+		offset -= n;
+	}
+
+	while (size < length) {
+
+		if (size == capacity) {
+			size_t new_capacity = capacity ? capacity * 2 : chunk;
+			void *tmp = ::mmap(0, new_capacity, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
+			if (tmp == MAP_FAILED) {
+				auto e = errno;
+				unmap();
+				return set_or_throw_error(ec, e, "mmap");
+			}
+			if (size) std::memcpy(tmp, data, size);
+			unmap();
+			data = tmp;
+			capacity = new_capacity;
+		}
+
+		ssize_t n = ::read(fd, (char *)data + size, std::min(capacity - size, length - size));
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			auto e = errno;
+			unmap();
+			return set_or_throw_error(ec, e, "read");
+		}
+		if (n == 0) break;
+		size += n;
+	}
+
+	if (size == 0) {
+		unmap();
+		return;
+	}
+
+	// release the unused tail pages.
+	size_t page = ::getpagesize();
+	size_t used = (size + page - 1) & ~(page - 1);
+	if (used < capacity)
+		::munmap((char *)data + used, capacity - used);
+
+	_data = data;
+	_size = size;
+	_flags = readonly;
+}
+
 
 void mapped_file_base::open(const std::string& p, mapmode flags, size_t length, size_t offset, std::error_code *ec) {
+	open(AT_FDCWD, p, flags, length, offset, read_threshold(), ec);
+}
+
+void mapped_file_base::open(int dirfd, const std::string& p, mapmode flags, size_t length, size_t offset, size_t threshold, std::error_code *ec) {
 
 	if (ec) ec->clear();
 
@@ -266,26 +389,34 @@ void mapped_file_base::open(const std::string& p, mapmode flags, size_t length,
 		break;
 	}
 
-	fd = ::open(p.c_str(), oflags);
+	fd = ::openat(dirfd, p.c_str(), oflags);
 	if (fd < 0) {
 		return set_or_throw_error(ec, "open");
 	}
 
 	auto close_fd = make_unique_resource(fd, ::close);
 
+	struct stat st;
 
-	if (length == -1) {
-		struct stat st;
+	if (::fstat(fd, &st) < 0) {
+		set_or_throw_error(ec, "stat");
+		return;
+	}
 
-		if (::fstat(fd, &st) < 0) {
-			set_or_throw_error(ec, "stat");
-			return;
-		}
+	if (flags != readwrite && (!S_ISREG(st.st_mode) || st.st_size == 0)) {
+		return open_stream(fd, length, offset, ec);
+	}
+
+	if (length == -1) {
 		length = st.st_size;
 	}
 
 	if (length == 0) return;
 
+	if (flags == readonly && offset == 0 && length <= (size_t)st.st_size && length <= threshold) {
+		return open_read(fd, length, ec);
+	}
+
 	_data = ::mmap(0, length, 
 		flags == readonly ? PROT_READ : PROT_READ | PROT_WRITE, 
 		flags == priv ? MAP_PRIVATE : MAP_SHARED, 
@@ -293,10 +424,13 @@ void mapped_file_base::open(const std::string& p, mapmode flags, size_t length,
 
 	if (_data == MAP_FAILED) {
 		_data = nullptr;
+		if (errno == ENODEV && flags != readwrite)
+			return open_stream(fd, length, offset, ec);
 		return set_or_throw_error(ec, "mmap");
 	}
 
-	_fd = close_fd.release();
+	/* a read-only mapping doesn't need the descriptor */
+	if (flags != readonly) _fd = close_fd.release();
 	_size = length;
 	_flags = flags;
 }
@@ -355,6 +489,7 @@ void mapped_file_base::reset() {
 	_map_handle = nullptr;
 #else
 	_fd = -1;
+	_heap = false;
 #endif
 }
 
@@ -369,6 +504,7 @@ void mapped_file_base::swap(mapped_file_base &rhs)
 		std::swap(_map_handle, rhs._map_handle);
 #else
 		std::swap(_fd, rhs._fd);
+		std::swap(_heap, rhs._heap);
 #endif
 	}
 }
@@ -27,6 +27,15 @@ public:
 
 	~mapped_file_base() { close(); }
 
+	/*
+	 * read-only regular files up to this size are read into a buffer rather
+	 * than mapped - for small files, mmap + page faults + munmap cost more
+	 * than a read.  0 always maps.  This is the default; the dirfd open
+	 * takes its own.
+	 */
+	static size_t read_threshold();
+	static void set_read_threshold(size_t size);
+
 protected:
 
 	void swap(mapped_file_base &rhs);
@@ -34,6 +43,12 @@ protected:
 	void open(const std::string &p, mapmode flags, size_t length, size_t offset, std::error_code *ec);
 	void create(const std::string &p, size_t new_size, std::error_code *ec); // always creates readwrite.
 
+#ifndef _WIN32
+	void open_stream(int fd, size_t length, size_t offset, std::error_code *ec);
+	void open_read(int fd, size_t length, std::error_code *ec);
+	void open(int dirfd, const std::string &p, mapmode flags, size_t length, size_t offset, size_t threshold, std::error_code *ec);
+#endif
+
 #ifdef _WIN32
 
 	void open(const std::wstring &p, mapmode flags, size_t length, size_t offset, std::error_code *ec);
@@ -59,6 +74,7 @@ protected:
 	void *_map_handle = nullptr;
 #else
 	int _fd = -1;
+	bool _heap = false; /* _data is malloc-ed (open_read) */
 #endif
 };
 
@@ -103,6 +119,16 @@ public:
 		open(p, flags, length, offset, ec);
 	}
 
+#ifndef _WIN32
+	/* relative paths are relative to the directory dirfd (or AT_FDCWD) */
+	mapped_file(int dirfd, const std::string &p, mapmode flags, std::error_code &ec) noexcept {
+		base::open(dirfd, p, flags, -1, 0, read_threshold(), &ec);
+	}
+	mapped_file(int dirfd, const std::string &p, mapmode flags, size_t threshold, std::error_code &ec) noexcept {
+		base::open(dirfd, p, flags, -1, 0, threshold, &ec);
+	}
+#endif
+
 #ifdef _WIN32
 	mapped_file(const std::wstring &p, mapmode flags = readonly, size_t length = -1, size_t offset = 0) {
 		open(p, flags, length, offset);
@@ -5,12 +5,12 @@
 #include <algorithm>
 #include <array>
 #include <optional>
+#include <system_error>
 
 #include <unistd.h>
 #include <fcntl.h>
-#include <err.h>
-#include <sysexits.h>
 #include <assert.h>
+#include <errno.h>
 
 
 #ifndef O_BINARY
@@ -300,60 +300,57 @@ enum {
 	SUPER_INTERSEG36,
 };
 
-uint32_t add_relocs(std::vector<uint8_t> &data, size_t data_offset, omf::segment &seg, bool compress, bool super) {
+int omf::super_type(const reloc &r, unsigned segnum) {
 
-	std::array< std::optional<super_helper>, 38 > ss;
+	if (!r.can_compress()) return -1;
 
+	if (r.shift == 0 && r.size == 2) return SUPER_RELOC2;
 
-	uint32_t reloc_size = 0;
+	// sreloc 3 is for 3 bytes.  however 4 bytes is also ok since
+	// it's 24-bit address space.
+	if (r.shift == 0 && r.size == 3) return SUPER_RELOC3;
 
-	for (auto &r : seg.relocs) {
+	// if size == 2 && shift == -16, -> SUPER INTERSEG
+	if (segnum <= 12 && r.shift == 0xf0 && r.size == 2) return SUPER_INTERSEG24 + segnum;
 
-		if (compress && r.can_compress()) {
+	return -1;
+}
 
-			if (super) {
-				if (r.shift == 0 && r.size == 2) {
-					constexpr int n = SUPER_RELOC2;
+int omf::super_type(const interseg &r, unsigned segment) {
 
-					auto &sr = ss[n];
-					if (!sr) sr.emplace();
-					sr->append(r.offset);
+	if (r.file != 1 || segment > 255 || r.offset > 0xffff || r.segment_offset > 0xffff) return -1;
 
-					uint32_t value = r.value;
-					for (int i = 0; i < 2; ++i, value >>= 8)
-						data[data_offset + r.offset + i] = value; 
-					continue;
-				}
+	if (r.shift == 0 && r.size == 3) return SUPER_INTERSEG1;
 
-				// sreloc 3 is for 3 bytes.  however 4 bytes is also ok since 
-				// it's 24-bit address space.
-				if (r.shift == 0 && (r.size == 2 || r.size == 3))
-				{
-					constexpr int n = SUPER_RELOC3;
+	if (segment <= 12 && r.size == 2) {
+		if (r.shift == 0) return SUPER_INTERSEG12 + segment;
+		if (r.shift == 0xf0) return SUPER_INTERSEG24 + segment;
+	}
+	return -1;
+}
 
-					auto &sr = ss[n];
-					if (!sr) sr.emplace();
-					sr->append(r.offset);
+uint32_t add_relocs(std::vector<uint8_t> &data, size_t data_offset, omf::segment &seg, bool compress, bool super) {
+
+	std::array< std::optional<super_helper>, 38 > ss;
 
-					uint32_t value = r.value;
-					for (int i = 0; i < 3; ++i, value >>= 8)
-						data[data_offset + r.offset + i] = value; 
-					continue;	
-				}
 
-				// if size == 2 && shift == -16, -> SUPER INTERSEG 
-				if (seg.segnum <= 12 && r.shift == 0xf0 && r.size == 2) {
+	uint32_t reloc_size = 0;
 
-					int n = SUPER_INTERSEG24 + seg.segnum;
-					auto &sr = ss[n];
-					if (!sr) sr.emplace();
-					sr->append(r.offset);
+	for (auto &r : seg.relocs) {
 
-					uint32_t value = r.value;
-					for (int i = 0; i < 2; ++i, value >>= 8)
-						data[data_offset + r.offset + i] = value; 
-					continue;
-				}
+		if (compress && r.can_compress()) {
+
+			int n = super ? omf::super_type(r, seg.segnum) : -1;
+			if (n >= 0) {
+				auto &sr = ss[n];
+				if (!sr) sr.emplace();
+				sr->append(r.offset);
+
+				int size = n == SUPER_RELOC3 ? 3 : 2;
+				uint32_t value = r.value;
+				for (int i = 0; i < size; ++i, value >>= 8)
+					data[data_offset + r.offset + i] = value; 
+				continue;
 			}
 
 			push(data, (uint8_t)omf::cRELOC);
@@ -375,48 +372,29 @@ uint32_t add_relocs(std::vector<uint8_t> &data, size_t data_offset, omf::segment
 	for (const auto &r : seg.intersegs) {
 		if (compress && r.can_compress()) {
 
-			if (super) {
-
-				if (r.shift == 0 && r.size == 3) {
-					constexpr int n = SUPER_INTERSEG1;
-					auto &sr = ss[n];
-					if (!sr) sr.emplace();
-					sr->append(r.offset);
-
-					uint32_t value = r.segment_offset;
-
-					data[data_offset + r.offset + 0] = value; value >>= 8;
-					data[data_offset + r.offset + 1] = value; value >>= 8;
-					data[data_offset + r.offset + 2] = r.segment;
-					continue;
-				}
+			int n = super ? omf::super_type(r, r.segment) : -1;
+			if (n == SUPER_INTERSEG1) {
+				auto &sr = ss[n];
+				if (!sr) sr.emplace();
+				sr->append(r.offset);
 
+				uint32_t value = r.segment_offset;
 
-				if (r.shift == 0 && r.size == 2 && r.segment <= 12) {
-
-					int n = SUPER_INTERSEG12 + r.segment;
-					auto &sr = ss[n];
-					if (!sr) sr.emplace();
-					sr->append(r.offset);
-
-					uint32_t value = r.segment_offset;
-					for (int i = 0; i < 2; ++i, value >>= 8)
-						data[data_offset + r.offset + i] = value; 
-					continue;
-				}
-
-				if (r.shift == 0xf0 && r.size == 2 && r.segment <= 12) {
+				data[data_offset + r.offset + 0] = value; value >>= 8;
+				data[data_offset + r.offset + 1] = value; value >>= 8;
+				data[data_offset + r.offset + 2] = r.segment;
+				continue;
+			}
 
-					int n = SUPER_INTERSEG24 + r.segment;
-					auto &sr = ss[n];
-					if (!sr) sr.emplace();
-					sr->append(r.offset);
+			if (n >= 0) {
+				auto &sr = ss[n];
+				if (!sr) sr.emplace();
+				sr->append(r.offset);
 
-					uint32_t value = r.segment_offset;
-					for (int i = 0; i < 2; ++i, value >>= 8)
-						data[data_offset + r.offset + i] = value; 
-					continue;
-				}
+				uint32_t value = r.segment_offset;
+				for (int i = 0; i < 2; ++i, value >>= 8)
+					data[data_offset + r.offset + i] = value; 
+				continue;
 			}
 
 
@@ -463,7 +441,7 @@ void save_bin(const std::string &path, omf::segment &segment) {
 	int fd;
 	fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0666);
 	if (fd < 0) {
-		err(EX_CANTCREAT, "Unable to open %s", path.c_str());
+		throw std::system_error(errno, std::generic_category(), "Unable to open");
 	}
 
 	uint32_t org = segment.org;
@@ -484,27 +462,21 @@ void save_bin(const std::string &path, omf::segment &segment) {
 
 	auto ok = write(fd, data.data(), data.size());
 	if (ok < 0) {
+		auto e = errno;
 		close(fd);
-		err(EX_OSERR, "write %s", path.c_str());
+		throw std::system_error(e, std::generic_category(), "write");
 	}
 	close(fd);
 }
 
-void save_object(const std::string &path, omf::segment &s, uint32_t length, unsigned version) {
-
-	/* data is already in OMF format. */
-
-	int fd;
-	fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0666);
-	if (fd < 0) {
-		err(EX_CANTCREAT, "Unable to open %s", path.c_str());
-	}
+/* header and names for an object segment.  data is already in OMF format. */
+static void object_header(std::vector<uint8_t> &out, const omf::segment &s, uint32_t length, unsigned version, unsigned segnum = 0) {
 
 	omf_header h;
 	h.length = length + s.reserved_space;
 	h.kind = s.kind;
 	h.banksize = length > 0xffff ? 0x0000 : 0x010000;
-	h.segnum = 0;
+	h.segnum = segnum;
 	h.alignment = s.alignment;
 	h.reserved_space = s.reserved_space;
 	h.org = s.org;
@@ -520,165 +492,291 @@ void save_object(const std::string &path, omf::segment &s, uint32_t length, unsi
 	h.dispdata = sizeof(omf_header) + data.size();
 	h.bytecount = sizeof(omf_header) + data.size() + s.data.size();
 
-	unsigned offset = 0;
 	if (version == 1) to_v1(h);
 	to_little(h);
-	offset += write(fd, &h, sizeof(h));
+
+	const uint8_t *cp = reinterpret_cast<const uint8_t *>(&h);
+	out.insert(out.end(), cp, cp + sizeof(h));
+	out.insert(out.end(), data.begin(), data.end());
+}
+
+void save_object(const std::string &path, omf::segment &s, uint32_t length, unsigned version) {
+
+	int fd;
+	fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0666);
+	if (fd < 0) {
+		throw std::system_error(errno, std::generic_category(), "Unable to open");
+	}
+
+	std::vector<uint8_t> data;
+	object_header(data, s, length, version);
+
+	unsigned offset = 0;
 	offset += write(fd, data.data(), data.size());
 	offset += write(fd, s.data.data(), s.data.size());
 	close(fd);
 }
 
-void save_omf(const std::string &path, std::vector<omf::segment> &segments, bool compress, bool expressload, unsigned version) {
+/*
+ * OMF library.  The LIBDICT segment (3 LCONST records - file names,
+ * symbol entries sorted by name, and symbol names) is followed by the members.
+ * Version 2 only, since v1 segments are block aligned.
+ */
+void save_library(const std::string &path, std::vector<omf::library_member> &members) {
+
+	std::vector<std::string> files;
+	std::vector<std::pair<std::string, unsigned>> symbols; /* name, member */
+
+	std::vector<unsigned> file_numbers;
+	for (unsigned i = 0; i < members.size(); ++i) {
+		auto &m = members[i];
+		auto iter = std::find(files.begin(), files.end(), m.file);
+		if (iter == files.end()) iter = files.insert(iter, m.file);
+		file_numbers.push_back(iter - files.begin() + 1);
+
+		for (const auto &name : m.globals) symbols.emplace_back(name, i);
+	}
+	std::sort(symbols.begin(), symbols.end());
 
-	// expressload doesn't support links to other files. 
-	// fortunately, we don't either.
+	std::vector<uint8_t> file_names;
+	for (unsigned i = 0; i < files.size(); ++i) {
+		push(file_names, static_cast<uint16_t>(i + 1));
+		push(file_names, files[i]);
+	}
 
-	// "compress" really means SUPER, not cRELOC/cINTERSEG
+	std::vector<uint8_t> names;
+	std::vector<uint32_t> name_offsets;
+	for (const auto &sym : symbols) {
+		name_offsets.push_back(names.size());
+		push(names, sym.first);
+	}
 
+	/* member images, so offsets are known */
+	std::vector<uint8_t> body;
+	std::vector<uint32_t> member_offsets;
+	for (const auto &m : members) {
+		member_offsets.push_back(body.size());
+		object_header(body, m.seg, m.length, 2, &m - members.data() + 2);
+		body.insert(body.end(), m.seg.data.begin(), m.seg.data.end());
+	}
 
-	// version 1 OMF lacks support for SUPER records or expressload.
+	omf::segment dict;
+	dict.kind = 0x08;
+	dict.segname = "LIBDICT";
+
+	/* the dictionary size doesn't depend on the offsets */
+	uint32_t base = 0;
+	for (int pass = 0; pass < 2; ++pass) {
+		std::vector<uint8_t> entries;
+		for (unsigned i = 0; i < symbols.size(); ++i) {
+			unsigned ix = symbols[i].second;
+			push(entries, name_offsets[i]);
+			push(entries, static_cast<uint16_t>(file_numbers[ix]));
+			push(entries, static_cast<uint16_t>(0)); /* public */
+			push(entries, base + member_offsets[ix]);
+		}
 
-	if (version == 1) {
-		compress = false;
-		expressload = false;
-	}
+		std::vector<uint8_t> data;
+		for (const auto *v : { &file_names, &entries, &names }) {
+			push(data, static_cast<uint8_t>(omf::opcode::LCONST));
+			push(data, static_cast<uint32_t>(v->size()));
+			data.insert(data.end(), v->begin(), v->end());
+		}
+		push(data, static_cast<uint8_t>(omf::opcode::END));
+		dict.data.assign(data.begin(), data.end());
 
-	std::vector<uint8_t> expr_headers;
-	std::vector<unsigned> expr_offsets;
+		std::vector<uint8_t> tmp;
+		object_header(tmp, dict, 0, 2, 1);
+		base = tmp.size() + dict.data.size();
+	}
 
 	int fd;
 	fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0666);
 	if (fd < 0) {
-		err(EX_CANTCREAT, "Unable to open %s", path.c_str());
+		throw std::system_error(errno, std::generic_category(), "Unable to open");
 	}
 
+	std::vector<uint8_t> data;
+	object_header(data, dict, 0, 2, 1);
+	data.insert(data.end(), dict.data.begin(), dict.data.end());
+	data.insert(data.end(), body.begin(), body.end());
 
-	uint32_t offset = 0;
-	if (expressload) {
-		for (auto &s : segments) {
-			s.segnum++;
-			for (auto &r : s.intersegs) r.segment++;
-		}
+	ssize_t ok = write(fd, data.data(), data.size());
+	int e = errno;
+	close(fd);
+	if (ok != (ssize_t)data.size()) {
+		throw std::system_error(ok < 0 ? e : EIO, std::generic_category(), "Unable to write");
+	}
+}
+
+namespace omf {
+
+writer::writer(const std::string &path, const std::vector<segment> &segments, bool compress, bool expressload, unsigned version) :
+	_compress(compress), _express(expressload), _version(version), _count(segments.size())
+{
+
+	// expressload doesn't support links to other files. 
+	// fortunately, we don't either.
+
+	// "compress" really means SUPER, not cRELOC/cINTERSEG
+
+
+	// version 1 OMF lacks support for SUPER records or expressload.
+
+	if (_version == 1) {
+		_compress = false;
+		_express = false;
+	}
+
+	_fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0666);
+	if (_fd < 0) {
+		throw std::system_error(errno, std::generic_category(), "Unable to open");
+	}
 
+	if (_express) {
 		// calculate express load segment size.
 		// sizeof includes the trailing 0, so no need to add in byte size.
-		offset = sizeof(omf_header) + 10 + sizeof("~ExpressLoad");
+		_offset = sizeof(omf_header) + 10 + sizeof("~ExpressLoad");
 
-		offset += 6; // lconst + end
-		offset += 6;  // header.
+		_offset += 6; // lconst + end
+		_offset += 6;  // header.
 		for (auto &s : segments) {
-			offset += 8 + 2;
-			offset += sizeof(omf_express_header) + 10;
-			offset += s.segname.length() + 1;
+			_offset += 8 + 2;
+			_offset += sizeof(omf_express_header) + 10;
+			_offset += s.segname.length() + 1;
 		}
 
-		lseek(fd, offset, SEEK_SET);
+		lseek(_fd, _offset, SEEK_SET);
 	}
+}
 
+writer::~writer() {
+	if (_fd >= 0) ::close(_fd);
+}
 
-	for (auto &s : segments) {
-		omf_header h;
-		h.length = s.data.size() + s.reserved_space;
-		h.kind = s.kind;
-		h.banksize = s.data.size() > 0xffff ? 0x0000 : 0x010000;
-		h.segnum = s.segnum;
-		h.alignment = s.alignment;
-		h.reserved_space = s.reserved_space;
-		h.org = s.org;
-
-		uint32_t reserved_space = 0;
-		if (expressload) {
-			std::swap(reserved_space, h.reserved_space);
-		}
+void writer::put(const void *data, size_t size) {
+	ssize_t ok = ::write(_fd, data, size);
+	if (ok != (ssize_t)size) {
+		throw std::system_error(ok < 0 ? errno : EIO, std::generic_category(), "Unable to write");
+	}
+	_offset += size;
+}
 
-		// length field INCLUDES reserved space.  Express expand reserved space.
+void writer::write_segment(segment &s) {
 
+	if (_express) {
+		s.segnum++;
+		for (auto &r : s.intersegs) r.segment++;
+	}
 
-		std::vector<uint8_t> data;
+	omf_header h;
+	h.length = s.data.size() + s.reserved_space;
+	h.kind = s.kind;
+	h.banksize = s.data.size() > 0xffff ? 0x0000 : 0x010000;
+	h.segnum = s.segnum;
+	h.alignment = s.alignment;
+	h.reserved_space = s.reserved_space;
+	h.org = s.org;
 
-		// push segname and load name onto data.
-		// data.insert(data.end(), 10, ' ');
-		push(data, s.loadname, 10);
-		push(data, s.segname);
+	uint32_t reserved_space = 0;
+	if (_express) {
+		std::swap(reserved_space, h.reserved_space);
+	}
 
-		h.dispname = sizeof(omf_header);
-		h.dispdata = sizeof(omf_header) + data.size();
+	// length field INCLUDES reserved space.  Express expand reserved space.
 
 
+	auto &data = _data;
+	data.clear();
+	data.reserve(s.data.size() + reserved_space + 64);
 
-		uint32_t lconst_offset = offset + sizeof(omf_header) + data.size() + 5;
-		uint32_t lconst_size = s.data.size() + reserved_space;
+	// push segname and load name onto data.
+	// data.insert(data.end(), 10, ' ');
+	push(data, s.loadname, 10);
+	push(data, s.segname);
 
+	h.dispname = sizeof(omf_header);
+	h.dispdata = sizeof(omf_header) + data.size();
 
-		//lconst record
-		push(data, (uint8_t)omf::LCONST);
-		push(data, (uint32_t)lconst_size);
 
-		size_t data_offset = data.size();
 
-		data.insert(data.end(), s.data.begin(), s.data.end());
+	uint32_t lconst_offset = _offset + sizeof(omf_header) + data.size() + 5;
+	uint32_t lconst_size = s.data.size() + reserved_space;
 
-		if (reserved_space) {
-			data.insert(data.end(), reserved_space, 0);
-		}
 
-		uint32_t reloc_offset = offset + sizeof(omf_header) + data.size();
-		uint32_t reloc_size = 0;
+	//lconst record
+	push(data, (uint8_t)omf::LCONST);
+	push(data, (uint32_t)lconst_size);
 
-		reloc_size = add_relocs(data, data_offset, s, true, compress);
+	size_t data_offset = data.size();
 
-		// end-of-record
-		push(data, (uint8_t)omf::END);
+	data.insert(data.end(), s.data.begin(), s.data.end());
 
-		h.bytecount = data.size() + sizeof(omf_header);
+	if (reserved_space) {
+		data.insert(data.end(), reserved_space, 0);
+	}
 
-		if (expressload) {
-
-			expr_offsets.emplace_back(expr_headers.size());
-
-			if (lconst_size == 0) lconst_offset = 0;
-			if (reloc_size == 0) reloc_offset = 0;
-
-
-			push(expr_headers, (uint32_t)lconst_offset);
-			push(expr_headers, (uint32_t)lconst_size);
-			push(expr_headers, (uint32_t)reloc_offset);
-			push(expr_headers, (uint32_t)reloc_size);
-
-			push(expr_headers, h.unused1);
-			push(expr_headers, h.lablen);
-			push(expr_headers, h.numlen);
-			push(expr_headers, h.version);
-			push(expr_headers, h.banksize);
-			push(expr_headers, h.kind);
-			push(expr_headers, h.unused2);
-			push(expr_headers, h.org);
-			push(expr_headers, h.alignment);
-			push(expr_headers, h.numsex);
-			push(expr_headers, h.unused3);
-			push(expr_headers, h.segnum);
-			push(expr_headers, h.entry);
-			push(expr_headers, (uint16_t)(h.dispname));
-			push(expr_headers, h.dispdata);
-
-			expr_headers.insert(expr_headers.end(), 10, ' ');
-			push(expr_headers, s.segname);
-		}
+	uint32_t reloc_offset = _offset + sizeof(omf_header) + data.size();
+	uint32_t reloc_size = 0;
 
-		if (version == 1) to_v1(h);
-		to_little(h);
-		offset += write(fd, &h, sizeof(h));
-		offset += write(fd, data.data(), data.size());
+	reloc_size = add_relocs(data, data_offset, s, true, _compress);
 
-		// version 1 needs 512-byte padding for all but final segment.
-		if (version == 1 && &s != &segments.back()) {
-			static uint8_t zero[512];
-			offset += write(fd, zero, 512 - (offset & 511) );
-		}
+	// end-of-record
+	push(data, (uint8_t)omf::END);
+
+	h.bytecount = data.size() + sizeof(omf_header);
+
+	if (_express) {
+
+		_expr_offsets.emplace_back(_expr_headers.size());
+		_segnums.push_back(s.segnum);
+
+		if (lconst_size == 0) lconst_offset = 0;
+		if (reloc_size == 0) reloc_offset = 0;
+
+		auto &eh = _expr_headers;
+
+		push(eh, (uint32_t)lconst_offset);
+		push(eh, (uint32_t)lconst_size);
+		push(eh, (uint32_t)reloc_offset);
+		push(eh, (uint32_t)reloc_size);
+
+		push(eh, h.unused1);
+		push(eh, h.lablen);
+		push(eh, h.numlen);
+		push(eh, h.version);
+		push(eh, h.banksize);
+		push(eh, h.kind);
+		push(eh, h.unused2);
+		push(eh, h.org);
+		push(eh, h.alignment);
+		push(eh, h.numsex);
+		push(eh, h.unused3);
+		push(eh, h.segnum);
+		push(eh, h.entry);
+		push(eh, (uint16_t)(h.dispname));
+		push(eh, h.dispdata);
+
+		eh.insert(eh.end(), 10, ' ');
+		push(eh, s.segname);
+	}
+
+	if (_version == 1) to_v1(h);
+	to_little(h);
+	put(&h, sizeof(h));
+	put(data.data(), data.size());
+
+	// version 1 needs 512-byte padding for all but final segment.
+	++_written;
+	if (_version == 1 && _written != _count) {
+		static uint8_t zero[512];
+		put(zero, 512 - (_offset & 511));
 	}
+}
 
-	if (expressload) {
+void writer::close() {
+
+	if (_express) {
 		omf_header h;
 		h.segnum = 1;
 		h.banksize = 0x00010000;
@@ -686,42 +784,55 @@ void save_omf(const std::string &path, std::vector<omf::segment> &segments, bool
 		h.dispname = 0x2c;
 		h.dispdata = 0x43;
 
-		unsigned fudge = 10 * segments.size();
+		unsigned fudge = 10 * _count;
 
-		h.length = 6 + expr_headers.size() + fudge;
+		h.length = 6 + _expr_headers.size() + fudge;
 
-		std::vector<uint8_t> data;
+		auto &data = _data;
+		data.clear();
 		data.insert(data.begin(), 10, ' ');
 		push(data, std::string("~ExpressLoad"));
 		push(data, (uint8_t)0xf2); // lconst.
 		push(data, (uint32_t)h.length);
 
 		push(data, (uint32_t)0); // reserved
-		push(data, (uint16_t)(segments.size() - 1)); // seg count - 1
+		push(data, (uint16_t)(_count - 1)); // seg count - 1
 
 
-		for (auto &offset : expr_offsets) {
+		for (auto &offset : _expr_offsets) {
 			push(data, (uint16_t)(fudge + offset));
 			push(data, (uint16_t)0);
 			push(data, (uint32_t)0);
 			fudge -= 8;
 		}
 
-		for (auto &s : segments) {
-			push(data, (uint16_t)s.segnum);
+		for (auto segnum : _segnums) {
+			push(data, (uint16_t)segnum);
 		}
 
-		data.insert(data.end(), expr_headers.begin(), expr_headers.end());
+		data.insert(data.end(), _expr_headers.begin(), _expr_headers.end());
 		push(data, (uint8_t)0); // end.
 
 		h.bytecount = data.size() + sizeof(omf_header);
 
 		to_little(h);
-		lseek(fd, 0, SEEK_SET);
-		write(fd, &h, sizeof(h));
-		write(fd, data.data(), data.size());
+		lseek(_fd, 0, SEEK_SET);
+		put(&h, sizeof(h));
+		put(data.data(), data.size());
+	}
 
+	int fd = _fd;
+	_fd = -1;
+	if (::close(fd) < 0) {
+		throw std::system_error(errno, std::generic_category(), "Unable to write");
 	}
+}
 
-	close(fd);
+}
+
+void save_omf(const std::string &path, std::vector<omf::segment> &segments, bool compress, bool expressload, unsigned version) {
+
+	omf::writer w(path, segments, compress, expressload, version);
+	for (auto &s : segments) w.write_segment(s);
+	w.close();
 }
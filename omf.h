@@ -4,6 +4,9 @@
 #include <stdint.h>
 #include <vector>
 #include <string>
+#include <string_view>
+
+#include "arena.h"
 
 namespace omf {
 
@@ -71,12 +74,134 @@ namespace omf {
 		std::string loadname;
 		std::string segname;
 
-		std::vector<uint8_t> data;
-		std::vector<interseg> intersegs;
-		std::vector<reloc> relocs;
+		arena_vector<uint8_t> data;
+		arena_vector<interseg> intersegs;
+		arena_vector<reloc> relocs;
+
+		segment() = default;
+
+		/* data and relocations from a link arena */
+		explicit segment(const arena_allocator<uint8_t> &a) :
+			data(a), intersegs(a), relocs(a)
+		{}
+	};
+
+	/*
+	 * The SUPER record type the writer uses for a relocation, or -1 for a
+	 * cRELOC/cINTERSEG (or full) record.  Segment numbers are as written,
+	 * so 1 more with ExpressLoad.
+	 */
+	int super_type(const reloc &r, unsigned segnum);
+	int super_type(const interseg &r, unsigned segment);
+
+	/* library ($B2) member. data is already in OMF record format. */
+	struct library_member {
+		segment seg;
+		uint32_t length = 0;
+		std::string file;
+		std::vector<std::string> globals;
+	};
+
+
+	/*
+	 * Load file writer, one segment at a time - a segment's data may be freed
+	 * as soon as it's written.  The ExpressLoad segment goes first in the file
+	 * but is written by close(), so the names of all segments are needed up front.
+	 * Throws std::system_error.
+	 */
+	class writer {
+	public:
+		writer(const std::string &path, const std::vector<segment> &segments,
+			bool compress, bool expressload, unsigned version = 2);
+		~writer();
+
+		writer(const writer &) = delete;
+		writer &operator=(const writer &) = delete;
+
+		/* nb - SUPER relocation values are stored in s.data, and ExpressLoad renumbers s */
+		void write_segment(segment &s);
+		void close();
+
+	private:
+		void put(const void *data, size_t size);
+
+		int _fd = -1;
+		bool _compress = true;
+		bool _express = true;
+		unsigned _version = 2;
+		size_t _count = 0;
+		size_t _written = 0;
+		uint32_t _offset = 0;
+
+		std::vector<uint8_t> _data;
+		std::vector<uint8_t> _expr_headers;
+		std::vector<unsigned> _expr_offsets;
+		std::vector<uint16_t> _segnums;
 	};
 
 
+	/* reading. nothing is copied - views point into the caller's buffer. */
+
+	struct segment_view {
+		uint32_t bytecount = 0;
+		uint32_t reserved_space = 0;
+		uint32_t length = 0;
+		uint8_t lablen = 0;
+		uint8_t numlen = 4;
+		uint8_t version = 2;
+		uint32_t banksize = 0;
+		uint16_t kind = 0;
+		uint32_t org = 0;
+		uint32_t alignment = 0;
+		uint16_t segnum = 0;
+		uint32_t entry = 0;
+
+		std::string_view loadname;
+		std::string_view segname;
+
+		/* records, from dispdata to the end of the segment */
+		const uint8_t *body = nullptr;
+		size_t body_size = 0;
+	};
+
+	/* parse the segment at data. returns the segment size in the file, or 0 if it's invalid. */
+	size_t read_segment(const uint8_t *data, size_t size, segment_view &seg);
+
+
+	struct record {
+		uint8_t opcode = 0;
+		const uint8_t *data = nullptr; /* starts with the opcode */
+		size_t size = 0;
+	};
+
+	/* walks the records of a segment, stopping at END. throws on a malformed record. */
+	class record_reader {
+	public:
+		record_reader(const segment_view &seg) :
+			_cp(seg.body), _end(seg.body + seg.body_size),
+			_lablen(seg.lablen), _numlen(seg.numlen), _version(seg.version)
+		{}
+
+		bool next(record &r);
+
+		/* field helpers, for the caller to decode a record. cp is advanced. */
+		uint32_t number(const uint8_t *&cp) const;
+		std::string_view label(const uint8_t *&cp) const;
+		void skip_expression(const uint8_t *&cp) const;
+
+		/* GLOBAL/LOCAL length attribute is 1 byte in v1, 2 in v2 */
+		unsigned attr_size() const { return _version == 1 ? 1 : 2; }
+
+	private:
+		void need(const uint8_t *cp, size_t n) const;
+
+		const uint8_t *_cp;
+		const uint8_t *_end;
+		uint8_t _lablen;
+		uint8_t _numlen;
+		uint8_t _version;
+	};
+
 }
 
 #endif
@@ -0,0 +1,237 @@
+#include "omf.h"
+
+#include <string>
+#include <string_view>
+#include <stdexcept>
+
+namespace {
+
+	uint32_t read16(const uint8_t *cp) {
+		return cp[0] | (cp[1] << 8);
+	}
+
+	uint32_t read32(const uint8_t *cp) {
+		return cp[0] | (cp[1] << 8) | (cp[2] << 16) | (cp[3] << 24);
+	}
+
+}
+
+namespace omf {
+
+size_t read_segment(const uint8_t *data, size_t size, segment_view &seg) {
+
+	if (size < 44) return 0;
+
+	seg = segment_view();
+
+	seg.version = data[15];
+	seg.numlen = data[14];
+	seg.lablen = data[13];
+
+	if (seg.version == 1) {
+		seg.bytecount = read32(data + 0) * 512;
+		seg.kind = data[12];
+	} else if (seg.version == 2) {
+		seg.bytecount = read32(data + 0);
+		seg.kind = read16(data + 20);
+	} else return 0;
+
+	if (seg.numlen != 4) return 0;
+	if (data[32] != 0) return 0; /* numsex */
+
+	seg.reserved_space = read32(data + 4);
+	seg.length = read32(data + 8);
+	seg.banksize = read32(data + 16);
+	seg.org = read32(data + 24);
+	seg.alignment = read32(data + 28);
+	seg.segnum = read16(data + 34);
+	seg.entry = read32(data + 36);
+
+	uint32_t dispname = read16(data + 40);
+	uint32_t dispdata = read16(data + 42);
+
+	/* v1 block count may overshoot the end of the file */
+	if (seg.version == 1 && seg.bytecount > size) seg.bytecount = size;
+
+	if (seg.bytecount > size || seg.bytecount < dispdata) return 0;
+	if (dispname + 10 >= dispdata) return 0;
+
+	seg.loadname = std::string_view((const char *)data + dispname, 10);
+
+	const uint8_t *cp = data + dispname + 10;
+	size_t n = seg.lablen;
+	if (!n) n = *cp++;
+	if (cp + n > data + dispdata) return 0;
+	seg.segname = std::string_view((const char *)cp, n);
+
+	seg.body = data + dispdata;
+	seg.body_size = seg.bytecount - dispdata;
+	return seg.bytecount;
+}
+
+
+void record_reader::need(const uint8_t *cp, size_t n) const {
+	if (cp + n > _end)
+		throw std::runtime_error("truncated OMF record");
+}
+
+uint32_t record_reader::number(const uint8_t *&cp) const {
+	need(cp, 4);
+	uint32_t rv = read32(cp);
+	cp += 4;
+	return rv;
+}
+
+std::string_view record_reader::label(const uint8_t *&cp) const {
+	size_t n = _lablen;
+	if (!n) {
+		need(cp, 1);
+		n = *cp++;
+	}
+	need(cp, n);
+	std::string_view rv((const char *)cp, n);
+	cp += n;
+	return rv;
+}
+
+void record_reader::skip_expression(const uint8_t *&cp) const {
+	for(;;) {
+		need(cp, 1);
+		uint8_t op = *cp++;
+		switch(op) {
+			case 0x00: return; /* end */
+			case 0x80: break; /* location counter */
+			case 0x81: /* absolute */
+			case 0x87: /* relative */
+				number(cp);
+				break;
+			case 0x82: /* weak reference */
+			case 0x83: /* label */
+			case 0x84: /* length attribute */
+			case 0x85: /* type attribute */
+			case 0x86: /* count attribute */
+				label(cp);
+				break;
+			default:
+				if (op > 0x15) throw std::runtime_error("bad OMF expression");
+				break; /* operator */
+		}
+	}
+}
+
+bool record_reader::next(record &r) {
+
+	need(_cp, 1);
+
+	const uint8_t *cp = _cp;
+	uint8_t op = *cp++;
+
+	switch(op) {
+		case END:
+			r.opcode = op;
+			r.data = _cp;
+			r.size = 1;
+			return false;
+
+		case ALIGN:
+		case ORG:
+		case DS:
+			number(cp);
+			break;
+
+		case RELOC:
+			need(cp, 2); cp += 2;
+			number(cp);
+			number(cp);
+			break;
+
+		case INTERSEG:
+			need(cp, 2); cp += 2;
+			number(cp);
+			need(cp, 4); cp += 4;
+			number(cp);
+			break;
+
+		case USING:
+		case STRONG:
+			label(cp);
+			break;
+
+		case GLOBAL:
+		case LOCAL:
+			label(cp);
+			need(cp, attr_size() + 2);
+			cp += attr_size() + 2;
+			break;
+
+		case GEQU:
+		case EQU:
+			label(cp);
+			need(cp, attr_size() + 2);
+			cp += attr_size() + 2;
+			skip_expression(cp);
+			break;
+
+		case MEM:
+			number(cp);
+			number(cp);
+			break;
+
+		case EXPR:
+		case ZEXPR:
+		case BEXPR:
+		case LEXPR:
+			need(cp, 1); cp += 1;
+			skip_expression(cp);
+			break;
+
+		case RELEXPR:
+			need(cp, 1); cp += 1;
+			number(cp);
+			skip_expression(cp);
+			break;
+
+		case LCONST: {
+			uint32_t n = number(cp);
+			need(cp, n);
+			cp += n;
+			break;
+		}
+
+		case ENTRY:
+			need(cp, 2); cp += 2;
+			number(cp);
+			label(cp);
+			break;
+
+		case cRELOC:
+			need(cp, 6); cp += 6;
+			break;
+
+		case cINTERSEG:
+			need(cp, 7); cp += 7;
+			break;
+
+		case SUPER: {
+			uint32_t n = number(cp);
+			need(cp, n);
+			cp += n;
+			break;
+		}
+
+		default:
+			if (op > 0xdf) throw std::runtime_error("bad OMF record");
+			/* CONST */
+			need(cp, op);
+			cp += op;
+			break;
+	}
+
+	r.opcode = op;
+	r.data = _cp;
+	r.size = cp - _cp;
+	_cp = cp;
+	return true;
+}
+
+}
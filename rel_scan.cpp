@@ -0,0 +1,83 @@
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_X86_SIMD
+#include <immintrin.h>
+#endif
+
+#include "rel_scan.h"
+
+namespace {
+
+	size_t scan_scalar(const uint8_t *data, size_t size, size_t i) {
+		for (; i < size; i += 4) {
+			if (data[i] == 0) return i;
+		}
+		return size;
+	}
+
+#ifdef HAVE_X86_SIMD
+
+	/* flag bytes are at 0, 4, 8, ... */
+
+	__attribute__((target("sse2")))
+	size_t scan_sse2(const uint8_t *data, size_t size) {
+		const __m128i zero = _mm_setzero_si128();
+		size_t i = 0;
+		for (; i + 16 <= size; i += 16) {
+			__m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + i));
+			unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, zero)) & 0x1111;
+			if (mask) return i + __builtin_ctz(mask);
+		}
+		return scan_scalar(data, size, i);
+	}
+
+	__attribute__((target("avx2")))
+	size_t scan_avx2(const uint8_t *data, size_t size) {
+		const __m256i zero = _mm256_setzero_si256();
+		size_t i = 0;
+		for (; i + 32 <= size; i += 32) {
+			__m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(data + i));
+			unsigned mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, zero)) & 0x11111111;
+			if (mask) return i + __builtin_ctz(mask);
+		}
+		return scan_scalar(data, size, i);
+	}
+
+	typedef size_t (*scan_fn)(const uint8_t *, size_t);
+
+	scan_fn select_scan() {
+		__builtin_cpu_init();
+		if (__builtin_cpu_supports("avx2")) return scan_avx2;
+		if (__builtin_cpu_supports("sse2")) return scan_sse2;
+		return [](const uint8_t *data, size_t size) { return scan_scalar(data, size, 0); };
+	}
+
+#endif
+}
+
+size_t rel_reloc_end(const uint8_t *data, size_t size) {
+#ifdef HAVE_X86_SIMD
+	static const scan_fn fn = select_scan();
+	return fn(data, size);
+#else
+	return scan_scalar(data, size, 0);
+#endif
+}
+
+bool rel_label_index(const uint8_t *data, size_t size, std::vector<uint32_t> &offsets) {
+
+	size_t i = 0;
+	while (i < size) {
+		unsigned flag = data[i];
+		if (flag == 0) return true;
+
+		size_t len = (flag & 0x1f) + 4;
+		if (i + len > size) return false;
+		offsets.push_back(i);
+		i += len;
+	}
+	return false;
+}
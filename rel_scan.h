@@ -0,0 +1,25 @@
+#ifndef rel_scan_h
+#define rel_scan_h
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+/*
+ * REL dictionary scanning.
+ *
+ * The relocation dictionary is a list of 4-byte records (shift records are
+ * 2 of them, the second never starting with 0) ending with a 0 byte.
+ * rel_reloc_end() returns the offset of that terminator, or size if
+ * there isn't one.  Uses SSE2/AVX2 when the cpu has them.
+ */
+size_t rel_reloc_end(const uint8_t *data, size_t size);
+
+/*
+ * Offsets of each label dictionary entry (flag | length, name, 3-byte value).
+ * Entries are variable length so this is sequential.  Returns false if the
+ * dictionary runs past size.
+ */
+bool rel_label_index(const uint8_t *data, size_t size, std::vector<uint32_t> &offsets);
+
+#endif
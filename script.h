@@ -21,6 +21,9 @@ enum {
 	OVR_OFF = 0
 };
 
+/* returns OP_NONE for blank/comment lines. operand points to the operand field. */
+opcode_t parse_line(const char *line, label_t &label, const char *&operand);
+
 enum {
 	OP_OPTIONAL = 0,
 	OP_REQUIRED = 1,
@@ -0,0 +1,128 @@
+#include <algorithm>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <vector>
+
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+
+#include "symbol_file.h"
+
+namespace {
+
+	const char magic[6] = { 'M', 'L', 'S', 'Y', 'M', 0 };
+	enum { header_size = 16, entry_size = 16, version = 1 };
+
+	uint32_t read16(const uint8_t *cp) {
+		return cp[0] | (cp[1] << 8);
+	}
+
+	uint32_t read32(const uint8_t *cp) {
+		return cp[0] | (cp[1] << 8) | (cp[2] << 16) | (cp[3] << 24);
+	}
+
+	void push16(std::vector<uint8_t> &v, uint32_t x) {
+		v.push_back(x & 0xff);
+		v.push_back((x >> 8) & 0xff);
+	}
+
+	void push32(std::vector<uint8_t> &v, uint32_t x) {
+		push16(v, x);
+		push16(v, x >> 16);
+	}
+}
+
+void save_symbol_file(const std::string &path, std::vector<symbol_file_entry> &entries) {
+
+	std::sort(entries.begin(), entries.end(), [](const auto &a, const auto &b){
+		return a.name < b.name;
+	});
+
+	std::vector<uint8_t> data(magic, magic + sizeof(magic));
+	push16(data, version);
+	push32(data, entries.size());
+
+	uint32_t pool = 0;
+	for (const auto &e : entries) pool += e.name.size();
+	push32(data, pool);
+
+	pool = 0;
+	for (const auto &e : entries) {
+		if (e.name.size() > 0xffff) throw std::runtime_error("symbol name too long");
+		push32(data, pool);
+		push16(data, e.name.size());
+		push16(data, e.absolute ? 1 : 0);
+		push32(data, e.segment);
+		push32(data, e.value);
+		pool += e.name.size();
+	}
+	for (const auto &e : entries) data.insert(data.end(), e.name.begin(), e.name.end());
+
+	FILE *fp = fopen(path.c_str(), "wb");
+	if (!fp) throw std::system_error(errno, std::generic_category(), "Unable to open " + path);
+
+	bool ok = fwrite(data.data(), 1, data.size(), fp) == data.size();
+	ok = (fclose(fp) == 0) && ok;
+	if (!ok) throw std::system_error(errno, std::generic_category(), "Unable to write " + path);
+}
+
+
+symbol_file::symbol_file(const std::string &path) {
+
+	std::error_code ec;
+	_mf.open(path, ec);
+	if (ec) throw std::system_error(ec, "Unable to open " + path);
+
+	const uint8_t *data = _mf.data();
+	size_t size = _mf.size();
+
+	if (size < header_size || !std::equal(magic, magic + sizeof(magic), data) || read16(data + 6) != version)
+		throw std::runtime_error(path + ": not a symbol file");
+
+	_count = read32(data + 8);
+	uint32_t pool = read32(data + 12);
+
+	if ((size - header_size) / entry_size < _count || size - header_size - (size_t)_count * entry_size != pool)
+		throw std::runtime_error(path + ": invalid symbol file");
+
+	_index = data + header_size;
+	_pool = reinterpret_cast<const char *>(_index + (size_t)_count * entry_size);
+
+	for (uint32_t i = 0; i < _count; ++i) {
+		const uint8_t *cp = _index + i * entry_size;
+		if ((uint64_t)read32(cp) + read16(cp + 4) > pool)
+			throw std::runtime_error(path + ": invalid symbol file");
+	}
+}
+
+symbol_file_entry symbol_file::operator[](size_t i) const {
+
+	const uint8_t *cp = _index + i * entry_size;
+	symbol_file_entry e;
+	e.name = std::string_view(_pool + read32(cp), read16(cp + 4));
+	e.absolute = read16(cp + 6) & 0x01;
+	e.segment = read32(cp + 8);
+	e.value = read32(cp + 12);
+	return e;
+}
+
+bool symbol_file::find(std::string_view name, symbol_file_entry &e) const {
+
+	size_t lo = 0;
+	size_t hi = _count;
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		symbol_file_entry tmp = (*this)[mid];
+		int cmp = tmp.name.compare(name);
+		if (cmp == 0) {
+			e = tmp;
+			return true;
+		}
+		if (cmp < 0) lo = mid + 1;
+		else hi = mid;
+	}
+	return false;
+}
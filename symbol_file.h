@@ -0,0 +1,50 @@
+#ifndef symbol_file_h
+#define symbol_file_h
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "mapped_file.h"
+
+/*
+ * Binary symbol table.  Little endian.
+ *
+ * header: "MLSYM\0" version(2) count(4) pool size(4)
+ * index:  count entries, sorted by name:
+ *         name offset(4) name length(2) flags(2) segment(4) value(4)
+ * pool:   names, not terminated
+ *
+ * Meant to be mapped and searched in place.
+ */
+
+struct symbol_file_entry {
+	std::string_view name;
+	uint32_t value = 0;
+	uint32_t segment = 0;
+	bool absolute = false;
+};
+
+/* entries are sorted, so the names must be distinct */
+void save_symbol_file(const std::string &path, std::vector<symbol_file_entry> &entries);
+
+class symbol_file {
+public:
+
+	/* throws on error or if the file isn't valid */
+	explicit symbol_file(const std::string &path);
+
+	size_t size() const { return _count; }
+	symbol_file_entry operator[](size_t i) const;
+
+	bool find(std::string_view name, symbol_file_entry &e) const;
+
+private:
+	mapped_file _mf;
+	const uint8_t *_index = nullptr;
+	const char *_pool = nullptr;
+	uint32_t _count = 0;
+};
+
+#endif
@@ -0,0 +1,114 @@
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "symbol_index.h"
+
+symbol_index::key symbol_index::make_key(std::string_view name) {
+	key k;
+	std::memset(k.bytes, 0, key_size);
+	k.bytes[0] = name.size();
+	std::memcpy(k.bytes + 1, name.data(), name.size());
+	return k;
+}
+
+/* FNV-1a over the whole block. never 0. */
+uint32_t symbol_index::hash(const key &k) {
+	uint32_t h = 2166136261u;
+	for (unsigned i = 0; i <= k.bytes[0]; ++i) {
+		h ^= k.bytes[i];
+		h *= 16777619u;
+	}
+	return h ? h : 1;
+}
+
+bool symbol_index::equal(const key &a, const key &b) {
+#if defined(__SSE2__)
+	const __m128i *pa = reinterpret_cast<const __m128i *>(a.bytes);
+	const __m128i *pb = reinterpret_cast<const __m128i *>(b.bytes);
+	__m128i x = _mm_cmpeq_epi8(_mm_load_si128(pa), _mm_load_si128(pb));
+	__m128i y = _mm_cmpeq_epi8(_mm_load_si128(pa + 1), _mm_load_si128(pb + 1));
+	return _mm_movemask_epi8(_mm_and_si128(x, y)) == 0xffff;
+#else
+	return std::memcmp(a.bytes, b.bytes, key_size) == 0;
+#endif
+}
+
+void symbol_index::clear() {
+	_keys.assign(64, key());
+	_hashes.assign(64, 0);
+	_ids.assign(64, 0);
+	_count = 0;
+	_mask = 63;
+	_long.clear();
+}
+
+int symbol_index::find(std::string_view name) const {
+
+	if (name.size() >= key_size) {
+		auto iter = _long.find(std::string(name));
+		return iter == _long.end() ? -1 : (int)iter->second;
+	}
+
+	key k = make_key(name);
+	uint32_t h = hash(k);
+	for (size_t i = h & _mask; ; i = (i + 1) & _mask) {
+		if (_hashes[i] == 0) return -1;
+		if (_hashes[i] == h && equal(_keys[i], k)) return _ids[i];
+	}
+}
+
+unsigned symbol_index::insert(std::string_view name, unsigned id) {
+
+	if (name.size() >= key_size) {
+		return _long.emplace(std::string(name), id).first->second;
+	}
+
+	/* keep the load factor under 1/2 */
+	if ((_count + 1) * 2 > _mask + 1) grow();
+
+	key k = make_key(name);
+	uint32_t h = hash(k);
+	for (size_t i = h & _mask; ; i = (i + 1) & _mask) {
+		if (_hashes[i] == 0) {
+			_hashes[i] = h;
+			_keys[i] = k;
+			_ids[i] = id;
+			++_count;
+			return id;
+		}
+		if (_hashes[i] == h && equal(_keys[i], k)) return _ids[i];
+	}
+}
+
+void symbol_index::grow() {
+
+	size_t size = (_mask + 1) * 2;
+
+	std::vector<key> keys(size);
+	std::vector<uint32_t> hashes(size);
+	std::vector<unsigned> ids(size);
+
+	size_t mask = size - 1;
+	for (size_t j = 0; j <= _mask; ++j) {
+		uint32_t h = _hashes[j];
+		if (!h) continue;
+		size_t i = h & mask;
+		while (hashes[i]) i = (i + 1) & mask;
+		hashes[i] = h;
+		keys[i] = _keys[j];
+		ids[i] = _ids[j];
+	}
+
+	_keys.swap(keys);
+	_hashes.swap(hashes);
+	_ids.swap(ids);
+	_mask = mask;
+}
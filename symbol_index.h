@@ -0,0 +1,56 @@
+#ifndef symbol_index_h
+#define symbol_index_h
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+/*
+ * name -> symbol id.
+ *
+ * REL label names are at most 31 bytes, so keys are stored inline as
+ * fixed 32-byte blocks (length byte + name, zero padded) in an open
+ * addressing table along with their hash.  Comparing keys is then two
+ * 16-byte compares.  Longer names (OMF, -D) go to a regular map.
+ */
+class symbol_index {
+public:
+
+	symbol_index() { clear(); }
+
+	/* returns -1 if not found */
+	int find(std::string_view name) const;
+
+	/* adds name -> id if name isn't present. returns the id for name. */
+	unsigned insert(std::string_view name, unsigned id);
+
+	void clear();
+
+	size_t size() const { return _count + _long.size(); }
+
+private:
+
+	enum { key_size = 32 };
+
+	struct alignas(32) key {
+		uint8_t bytes[key_size];
+	};
+
+	static key make_key(std::string_view name);
+	static uint32_t hash(const key &k);
+	static bool equal(const key &a, const key &b);
+
+	void grow();
+
+	std::vector<key> _keys;
+	std::vector<uint32_t> _hashes; /* 0 = empty slot */
+	std::vector<unsigned> _ids;
+	size_t _count = 0;
+	size_t _mask = 0;
+
+	std::unordered_map<std::string, unsigned> _long;
+};
+
+#endif